@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "channelizer.h"
+
+/* Split a wideband capture into its channels, each written out as
+ * downmix would have written it: two doubles per sample, at 64/7 Msps,
+ * ready for ofdmvis or dvbt-multi.  Outputs can be fifos, so that one
+ * capture feeds every receiver as it goes.  */
+
+typedef struct channelize_out {
+	FILE *fp;
+	const char *name;
+	int64_t samples;
+	double buf[2 * (CHAN_BLOCK / CHAN_D * CHAN_OUT_L / CHAN_OUT_M + 4)];
+} channelize_out_t;
+
+static void channelize_output(void *priv, int c, const double *re, const double *im, int n) {
+	channelize_out_t *out = &((channelize_out_t *)priv)[c];
+
+	for (int i = 0; i < n; i++) {
+		out->buf[2 * i] = re[i];
+		out->buf[2 * i + 1] = im[i];
+	}
+	if (fwrite(out->buf, sizeof(double) * 2, n, out->fp) != (size_t)n) {
+		perror(out->name);
+		exit(1);
+	}
+	out->samples += n;
+}
+
+static double channelize_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+	static channelizer_t chan;
+	static channelize_out_t outs[CHAN_MAX];
+	static uint8_t buf[CHAN_BLOCK * 16];
+	double centre = 25710000.0, freqs[CHAN_MAX], start, secs;
+	const char *prefix = "chan";
+	int64_t total = 0;
+	int fd, nfreqs, opt;
+	ssize_t len;
+
+	while ((opt = getopt(argc, argv, "c:o:")) != -1) {
+		switch (opt) {
+		case 'c':
+			centre = atof(optarg) * 1e6;
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc || argc - optind - 1 > CHAN_MAX) {
+	usage:
+		fprintf(stderr, "usage: %s [-c MHz] [-o prefix] input [MHz=output ...]\n", argv[0]);
+		fprintf(stderr, "  -c: centre of any channel in the capture (default 25.71, as for downmix)\n");
+		fprintf(stderr, "  -o: with no channels given, write each one to prefix-MHz.raw (default chan)\n");
+		fprintf(stderr, "  input: real 8-bit samples at 76.5 Msps, as for downmix; - for stdin\n");
+		fprintf(stderr, "  MHz=output: the channel centred there, to a file or pipe (default: every one)\n");
+		return 1;
+	}
+
+	if (chan_init(&chan, centre, channelize_output, outs) < 0) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+
+	nfreqs = argc - optind - 1;
+	if (!nfreqs)
+		nfreqs = chan_list(centre, freqs, CHAN_MAX);
+	for (int i = 0; i < nfreqs; i++) {
+		char *name, *eq;
+		int c;
+
+		if (argc - optind > 1) {
+			eq = strchr(argv[optind + 1 + i], '=');
+			if (!eq)
+				goto usage;
+			freqs[i] = atof(argv[optind + 1 + i]) * 1e6;
+			name = eq + 1;
+		} else {
+			name = malloc(strlen(prefix) + 32);
+			if (!name) {
+				fprintf(stderr, "%s: out of memory\n", argv[0]);
+				return 1;
+			}
+			sprintf(name, "%s-%.2f.raw", prefix, freqs[i] * 1e-6);
+		}
+
+		c = chan_add(&chan, freqs[i]);
+		if (c < 0) {
+			fprintf(stderr, "%s: no channel at %.3f MHz: it has to be a multiple of %.0f MHz from %.3f MHz, "
+			        "and within the capture\n", argv[0], freqs[i] * 1e-6, CHAN_SPACING * 1e-6, centre * 1e-6);
+			return 1;
+		}
+		outs[c].name = name;
+		outs[c].fp = fopen(name, "wb");
+		if (!outs[c].fp) {
+			perror(name);
+			return 1;
+		}
+	}
+
+	if (!strcmp(argv[optind], "-"))
+		fd = 0;
+	else
+		fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	start = channelize_now();
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		chan_push(&chan, buf, len);
+		total += len;
+	}
+	chan_flush(&chan);
+	secs = channelize_now() - start;
+
+	for (int i = 0; i < chan.nchan; i++) {
+		fprintf(stderr, "%.3f MHz (bin %d): %lld samples to %s\n", chan.chan[i].freq * 1e-6,
+		        chan.chan[i].bin, (long long)outs[i].samples, outs[i].name);
+		fclose(outs[i].fp);
+		if (argc - optind == 1)
+			free((char *)outs[i].name); /* made up from the prefix */
+	}
+	fprintf(stderr, "%lld samples in %.2f s: %.2f Msamples/s\n", (long long)total, secs,
+	        secs > 0 ? total / secs * 1e-6 : 0.0);
+
+	chan_free(&chan);
+	close(fd);
+	return 0;
+}
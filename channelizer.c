@@ -0,0 +1,325 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include "dvbt.h"
+#include "channelizer.h"
+
+#define CHAN_P (CHAN_M * CHAN_TAPS)
+#define CHAN_OUT64 (CHAN_BLOCK * CHAN_IN_L / CHAN_IN_M + 2) /* most stage one puts out per pass */
+#define CHAN_KAISER_BETA 5.65 /* about 60 dB down */
+
+static double chan_i0(double x) {
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; term > 1e-12 * sum; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* Kaiser-windowed sinc lowpass, n taps at fs, cut off (at -6 dB) at fc.
+ * Scaled so that each of its l phases sums to about 1: interpolating by l
+ * doesn't change the level.  */
+static void chan_design(double *h, int n, int l, double fc, double fs) {
+	double sum = 0.0;
+
+	for (int i = 0; i < n; i++) {
+		double t = i - (n - 1) / 2.0;
+		double r = 2.0 * i / (n - 1) - 1.0;
+		double x = 2.0 * fc / fs * t;
+
+		h[i] = (x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x)) *
+		       chan_i0(CHAN_KAISER_BETA * sqrt(1.0 - r * r)) / chan_i0(CHAN_KAISER_BETA);
+		sum += h[i];
+	}
+	for (int i = 0; i < n; i++)
+		h[i] *= l / sum;
+}
+
+/* The mix that puts the channel raster through centre on multiples of
+ * CHAN_SPACING, as near as possible to the middle of the capture.  */
+static double chan_mix(double centre) {
+	return centre - CHAN_SPACING * round((centre - CHAN_IN_RATE / 4) / CHAN_SPACING);
+}
+
+/* A filter for chan_resample: l phases of taps each, from a design at the
+ * upsampled rate.  */
+static void chan_design_phases(double *h, int taps, int l, double fc, double fs) {
+	double proto[CHAN_IN_L * CHAN_IN_TAPS];
+
+	assert(l * taps <= CHAN_IN_L * CHAN_IN_TAPS);
+	chan_design(proto, l * taps, l, fc, fs);
+	for (int p = 0; p < l; p++)
+		for (int t = 0; t < taps; t++)
+			h[p * taps + t] = proto[p + (taps - 1 - t) * l];
+}
+
+/* Set up to split a capture with a channel at centre Hz; channels then
+ * have to be added, before anything is pushed.  Returns 0, or -1 if
+ * there's no memory for it.  */
+int chan_init(channelizer_t *c, double centre, chan_output_t output, void *priv) {
+	memset(c, 0, sizeof(*c));
+	c->mix = chan_mix(centre);
+	c->output = output;
+	c->priv = priv;
+
+	/* Stage one keeps everything within 23.125 MHz of the middle (the
+	 * capture is 38.25 MHz wide, and the mix is up to 4 MHz off centre),
+	 * and stops anything that would alias back into that at 64 Msps.  */
+	chan_design_phases(c->h_in, CHAN_IN_TAPS, CHAN_IN_L, CHAN_RATE / 2, CHAN_IN_RATE * CHAN_IN_L);
+
+	/* Each bin passes its own channel, and stops anything that would
+	 * alias into it at 16 Msps; its neighbours are half in, but the last
+	 * stage takes care of them.  */
+	chan_design(c->h, CHAN_P, 1, CHAN_SPACING, CHAN_RATE);
+
+	/* The last stage cuts off at the receiver's Nyquist frequency. */
+	chan_design_phases(c->h_out, CHAN_OUT_TAPS, CHAN_OUT_L, CHAN_OUT_RATE / 2,
+	                   CHAN_RATE / CHAN_D * CHAN_OUT_L);
+
+	/* The histories start out as delay lines full of zeroes. */
+	c->in_re = calloc(CHAN_IN_TAPS + CHAN_BLOCK, sizeof(double));
+	c->in_im = calloc(CHAN_IN_TAPS + CHAN_BLOCK, sizeof(double));
+	c->in_next = CHAN_IN_TAPS - 1;
+	c->hist_re = calloc(CHAN_P + CHAN_OUT64, sizeof(double));
+	c->hist_im = calloc(CHAN_P + CHAN_OUT64, sizeof(double));
+	c->nhist = CHAN_P - 1;
+	c->next = CHAN_P - 1;
+	c->nsamp = -(CHAN_P - 1);
+
+	c->re64 = malloc(CHAN_OUT64 * sizeof(double));
+	c->im64 = malloc(CHAN_OUT64 * sizeof(double));
+	c->out_re = malloc((CHAN_BLOCK / CHAN_D * CHAN_OUT_L / CHAN_OUT_M + 4) * sizeof(double));
+	c->out_im = malloc((CHAN_BLOCK / CHAN_D * CHAN_OUT_L / CHAN_OUT_M + 4) * sizeof(double));
+	c->fold = fftw_malloc(sizeof(fftw_complex) * CHAN_M * CHAN_BATCH);
+	c->bins = fftw_malloc(sizeof(fftw_complex) * CHAN_M * CHAN_BATCH);
+	if (!c->in_re || !c->in_im || !c->hist_re || !c->hist_im || !c->re64 || !c->im64 ||
+	    !c->out_re || !c->out_im || !c->fold || !c->bins) {
+		chan_free(c);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ofdm_fftw_lock);
+	c->plan = fftw_plan_many_dft(1, (int []){ CHAN_M }, CHAN_BATCH, c->fold, NULL, 1, CHAN_M,
+	                             c->bins, NULL, 1, CHAN_M, FFTW_BACKWARD, FFTW_MEASURE);
+	pthread_mutex_unlock(&ofdm_fftw_lock);
+	return 0;
+}
+
+/* Every channel that's wholly within the capture, on the same raster as
+ * centre, and near enough the middle for stage one to pass it.  Returns
+ * how many there are, up to max.  */
+int chan_list(double centre, double *freqs, int max) {
+	double mix = chan_mix(centre);
+	int n = 0;
+
+	for (int k = -CHAN_M / 2; k < CHAN_M / 2 && n < max; k++) {
+		double f = mix + k * CHAN_SPACING;
+
+		if (f - CHAN_HALF_BW > 0 && f + CHAN_HALF_BW < CHAN_IN_RATE / 2 &&
+		    fabs(f - mix) + CHAN_HALF_BW < CHAN_IN_RATE / 4 + CHAN_SPACING / 2)
+			freqs[n++] = f;
+	}
+	return n;
+}
+
+/* Ask for the channel at freq Hz.  Returns its number, as passed to the
+ * output callback, or -1 if it isn't one we can give.  */
+int chan_add(channelizer_t *c, double freq) {
+	double k = (freq - c->mix) / CHAN_SPACING;
+	chan_channel_t *ch;
+
+	if (c->nchan == CHAN_MAX || fabs(k - round(k)) * CHAN_SPACING > 1000.0)
+		return -1;
+	if (freq - CHAN_HALF_BW <= 0 || freq + CHAN_HALF_BW >= CHAN_IN_RATE / 2 ||
+	    fabs(freq - c->mix) + CHAN_HALF_BW >= CHAN_IN_RATE / 4 + CHAN_SPACING / 2)
+		return -1;
+
+	ch = &c->chan[c->nchan];
+	memset(ch, 0, sizeof(*ch));
+	ch->freq = freq;
+	ch->next = CHAN_OUT_TAPS - 1;
+	ch->bin = ((int)round(k) % CHAN_M + CHAN_M) % CHAN_M;
+	return c->nchan++;
+}
+
+/* Resample by l/m, as resamp_complex does, over n new samples at the end
+ * of re and im; there are taps - 1 older ones in front of them.  *next is
+ * the newest sample for the next output, and *phase its filter phase.
+ * This is where most of the time goes, so it's laid out for speed: each
+ * output is one pass, over both parts at once, along a phase's taps and
+ * the history, neither of which is strided, and the history stays where
+ * it is rather than being shifted along for every sample.  Returns how
+ * many outputs.  */
+static int chan_resample(const double *h, int l, int m, int taps, int *next, int *phase,
+                         double *re, double *im, int n, double *out_re, double *out_im) {
+	int nin = taps - 1 + n, nout = 0;
+
+	while (*next < nin) {
+		const double *p = h + *phase * taps;
+		const double *xr = re + *next - (taps - 1), *xi = im + *next - (taps - 1);
+		double sr = 0.0, si = 0.0;
+
+		for (int t = 0; t < taps; t++) {
+			sr += p[t] * xr[t];
+			si += p[t] * xi[t];
+		}
+		out_re[nout] = sr;
+		out_im[nout] = si;
+		nout++;
+
+		for (*phase += m; *phase >= l; *phase -= l)
+			(*next)++;
+	}
+
+	memmove(re, re + n, (taps - 1) * sizeof(double));
+	memmove(im, im + n, (taps - 1) * sizeof(double));
+	*next -= n;
+	return nout;
+}
+
+/* Pass the filter bank's outputs so far out to the channels. */
+static void chan_fft(channelizer_t *c) {
+	fftw_execute(c->plan);
+
+	for (int i = 0; i < c->nchan; i++) {
+		chan_channel_t *ch = &c->chan[i];
+
+		assert(ch->nbin + c->nfold <= CHAN_BLOCK / CHAN_D);
+		for (int j = 0; j < c->nfold; j++) {
+			ch->bin_re[CHAN_OUT_TAPS - 1 + ch->nbin] = c->bins[j * CHAN_M + ch->bin][0];
+			ch->bin_im[CHAN_OUT_TAPS - 1 + ch->nbin] = c->bins[j * CHAN_M + ch->bin][1];
+			ch->nbin++;
+		}
+	}
+	c->nfold = 0;
+}
+
+/* Bin k, at the output for sample s, is
+ *
+ *   y_k = sum_p h[p] x[s - p] e^(-2 pi i k (s - p) / M)
+ *
+ * which is x mixed down by k bins, and then filtered.  With p = m + t M,
+ * the exponent only depends on (m - s) mod M, so fold the sum over t
+ * first, put each fold where it belongs in that order, and one inverse
+ * FFT makes every bin out of them.  */
+static void chan_bank(channelizer_t *c, const double *re, const double *im, int n) {
+	int keep;
+
+	memcpy(c->hist_re + c->nhist, re, n * sizeof(double));
+	memcpy(c->hist_im + c->nhist, im, n * sizeof(double));
+	c->nhist += n;
+
+	for (; c->next < c->nhist; c->next += CHAN_D) {
+		fftw_complex *u = c->fold + c->nfold * CHAN_M;
+		const double *xr = c->hist_re + c->next, *xi = c->hist_im + c->next;
+		int rot = (int)(((c->nsamp + c->next) % CHAN_M + CHAN_M) % CHAN_M);
+
+		for (int m = 0; m < CHAN_M; m++) {
+			double sr = 0.0, si = 0.0;
+
+			for (int p = m; p < CHAN_P; p += CHAN_M) {
+				sr += c->h[p] * xr[-p];
+				si += c->h[p] * xi[-p];
+			}
+			u[(m - rot + CHAN_M) % CHAN_M][0] = sr;
+			u[(m - rot + CHAN_M) % CHAN_M][1] = si;
+		}
+		if (++c->nfold == CHAN_BATCH)
+			chan_fft(c);
+	}
+
+	/* Keep just enough history for the next output. */
+	keep = CHAN_P - 1;
+	memmove(c->hist_re, c->hist_re + c->nhist - keep, keep * sizeof(double));
+	memmove(c->hist_im, c->hist_im + c->nhist - keep, keep * sizeof(double));
+	c->next -= c->nhist - keep;
+	c->nsamp += c->nhist - keep;
+	c->nhist = keep;
+}
+
+static void chan_emit(channelizer_t *c) {
+	for (int i = 0; i < c->nchan; i++) {
+		chan_channel_t *ch = &c->chan[i];
+		int nout;
+
+		if (!ch->nbin)
+			continue;
+		nout = chan_resample(c->h_out, CHAN_OUT_L, CHAN_OUT_M, CHAN_OUT_TAPS, &ch->next, &ch->phase,
+		                     ch->bin_re, ch->bin_im, ch->nbin, c->out_re, c->out_im);
+		ch->nbin = 0;
+		if (nout)
+			c->output(c->priv, i, c->out_re, c->out_im, nout);
+	}
+}
+
+/* Capture samples in, as many as there are; the channels come out through
+ * the callback as they're ready.  */
+void chan_push(channelizer_t *c, const uint8_t *in, int n) {
+	double step = 2.0 * M_PI * c->mix / CHAN_IN_RATE;
+	double ds = sin(step), dc = cos(step);
+
+	while (n > 0) {
+		int len = n < CHAN_BLOCK ? n : CHAN_BLOCK;
+		double s = sin(c->mix_phase), co = cos(c->mix_phase);
+		double *re = c->in_re + CHAN_IN_TAPS - 1, *im = c->in_im + CHAN_IN_TAPS - 1;
+		int n64;
+
+		/* Mixed as downmix does it, but once for every channel; the
+		 * oscillator is restarted from the exact phase every block.  */
+		for (int i = 0; i < len; i++) {
+			double x = (in[i] - 127.5) / 127.5;
+			double t = s * dc + co * ds;
+
+			re[i] = x * s;
+			im[i] = x * co;
+			co = co * dc - s * ds;
+			s = t;
+		}
+		c->mix_phase = fmod(c->mix_phase + len * step, 2.0 * M_PI);
+
+		n64 = chan_resample(c->h_in, CHAN_IN_L, CHAN_IN_M, CHAN_IN_TAPS, &c->in_next, &c->in_phase,
+		                    c->in_re, c->in_im, len, c->re64, c->im64);
+		chan_bank(c, c->re64, c->im64, n64);
+		chan_emit(c);
+
+		in += len;
+		n -= len;
+	}
+}
+
+/* Send out whatever the filter bank still has; the FFT always does a
+ * whole batch, so pad it out.  */
+void chan_flush(channelizer_t *c) {
+	if (c->nfold) {
+		int nfold = c->nfold;
+
+		memset(c->fold + nfold * CHAN_M, 0, sizeof(fftw_complex) * CHAN_M * (CHAN_BATCH - nfold));
+		chan_fft(c);
+	}
+	chan_emit(c);
+}
+
+void chan_free(channelizer_t *c) {
+	if (c->plan) {
+		pthread_mutex_lock(&ofdm_fftw_lock);
+		fftw_destroy_plan(c->plan);
+		pthread_mutex_unlock(&ofdm_fftw_lock);
+	}
+	if (c->fold)
+		fftw_free(c->fold);
+	if (c->bins)
+		fftw_free(c->bins);
+	free(c->hist_re);
+	free(c->hist_im);
+	free(c->in_re);
+	free(c->in_im);
+	free(c->re64);
+	free(c->im64);
+	free(c->out_re);
+	free(c->out_im);
+	memset(c, 0, sizeof(*c));
+}
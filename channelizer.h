@@ -0,0 +1,106 @@
+#ifndef CHANNELIZER_H
+#define CHANNELIZER_H
+
+#include <stdint.h>
+#include <fftw3.h>
+
+/* Every 8 MHz channel in a wideband capture, in one pass.  The capture is
+ * what downmix takes: real 8-bit samples at 76.5 Msps.  On the way
+ * through:
+ *
+ *   - one mixer shifts the whole capture so that the channel raster lands
+ *     on multiples of 8 MHz, near the middle of the band;
+ *   - a polyphase resampler, as in multirate_algs, takes it from 76.5 to
+ *     64 Msps, complex, where 8 MHz is exactly an eighth of the sample rate;
+ *   - a polyphase filter bank splits that into 8 bins, 8 MHz apart, each
+ *     coming out at 16 Msps: every 4 samples, the history is weighted by
+ *     the prototype filter, folded into 8 values, and put through one
+ *     8-point FFT, which gives every bin at once;
+ *   - for each channel wanted, the resampler again, from 16 Msps to the
+ *     receiver's 64/7 Msps.
+ *
+ * The per-channel cost is the last step alone; everything before it is
+ * shared, in place of one mixer and decimator per channel.  */
+
+#define CHAN_IN_RATE 76500000.0
+#define CHAN_SPACING 8000000.0
+#define CHAN_HALF_BW 3810000.0 /* occupied, either side of the centre */
+
+/* 76.5 Msps -> 64 Msps */
+#define CHAN_IN_L 128
+#define CHAN_IN_M 153
+#define CHAN_IN_TAPS 16 /* per phase */
+
+/* The filter bank */
+#define CHAN_M 8 /* bins */
+#define CHAN_RATE (CHAN_M * CHAN_SPACING)
+#define CHAN_D 4 /* samples in per bin sample out */
+#define CHAN_TAPS 6 /* of the prototype, per bin */
+
+/* 16 Msps -> 64/7 Msps */
+#define CHAN_OUT_L 4
+#define CHAN_OUT_M 7
+#define CHAN_OUT_TAPS 40 /* per phase */
+#define CHAN_OUT_RATE (CHAN_RATE / CHAN_D * CHAN_OUT_L / CHAN_OUT_M)
+
+#define CHAN_MAX CHAN_M
+#define CHAN_BLOCK (CHAN_IN_M * 64) /* capture samples per pass */
+#define CHAN_BATCH 256 /* filter bank outputs per FFT call */
+
+/* n samples of channel c, at CHAN_OUT_RATE; the buffers are only good
+ * until this returns.  */
+typedef void (*chan_output_t)(void *priv, int c, const double *re, const double *im, int n);
+
+typedef struct chan_channel {
+	double freq; /* in the capture, Hz */
+	int bin; /* 0 .. CHAN_M - 1 */
+
+	/* Its bin, with enough history in front for the last stage */
+	double bin_re[CHAN_OUT_TAPS - 1 + CHAN_BLOCK / CHAN_D];
+	double bin_im[CHAN_OUT_TAPS - 1 + CHAN_BLOCK / CHAN_D];
+	int nbin; /* new since the last output */
+	int next, phase;
+} chan_channel_t;
+
+typedef struct channelizer {
+	double mix; /* Hz, shifted down to 0 */
+	double mix_phase; /* at the start of the next block, radians */
+
+	/* Stage one: the filter by phase, oldest sample first, and the mixed
+	 * input with enough history in front of it.  */
+	double h_in[CHAN_IN_L * CHAN_IN_TAPS];
+	double *in_re, *in_im;
+	int in_next, in_phase;
+
+	/* Filter bank: the prototype, newest sample first, and enough input
+	 * history for it.  */
+	double h[CHAN_M * CHAN_TAPS];
+	double *hist_re, *hist_im;
+	int nhist;
+	int next; /* in hist, the newest sample for the next output */
+	int64_t nsamp; /* samples in before hist[0], for the bin rotation */
+	fftw_complex *fold, *bins;
+	fftw_plan plan;
+	int nfold;
+
+	double h_out[CHAN_OUT_L * CHAN_OUT_TAPS];
+	chan_channel_t chan[CHAN_MAX];
+	int nchan;
+
+	chan_output_t output;
+	void *priv;
+
+	/* Scratch */
+	double *re64, *im64;
+	double *out_re, *out_im;
+} channelizer_t;
+
+/* channelizer.c */
+extern int chan_init(channelizer_t *c, double centre, chan_output_t output, void *priv);
+extern int chan_add(channelizer_t *c, double freq);
+extern int chan_list(double centre, double *freqs, int max);
+extern void chan_push(channelizer_t *c, const uint8_t *in, int n);
+extern void chan_flush(channelizer_t *c);
+extern void chan_free(channelizer_t *c);
+
+#endif
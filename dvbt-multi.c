@@ -0,0 +1,550 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "dvbt.h"
+#include "viterbi.h"
+#include "outer_decoder.h"
+#include "ts_sink.h"
+#include "workpool.h"
+
+/* Many muxes at once, in one process: for each, samples in from a file or
+ * pipe (as for ofdmvis), and the transport stream out (as for outerfast).
+ *
+ * Each mux is a chain of three tasks on one shared pool of workers: the
+ * demodulator, one symbol per run; the inner decoder, and the outer decoder
+ * with the TS sink, a block per run.  Between them are single-producer,
+ * single-consumer rings.  A stage only runs when there's input for it and
+ * room for its output, and wakes its neighbours when that changes, so a
+ * slow stage holds back the ones before it rather than piling up data.
+ * The only other threads are one per mux reading its input.
+ *
+ * Every task yields after each run, so with more muxes than workers they
+ * take turns; none of them can starve the others, however much input it
+ * has waiting.  */
+
+#define MUX_SAMPLES_SZ (1 << 22) /* bytes of samples buffered per mux */
+#define MUX_BITS_SZ (1 << 18) /* demodulated bits (or LLRs) */
+#define MUX_BYTES_SZ (1 << 17) /* decoded bytes */
+
+/* The estimator asks for at most 2N + L samples for a symbol, and a symbol
+ * puts out at most 6 LLRs per cell.  */
+#define MUX_SYMBOL_NEED ((2 * 8192 + 8192 / 4) * (int64_t)sizeof(fftw_complex))
+#define MUX_SYMBOL_BITS (DVBT_MAX_CELLS * 6)
+
+#define MUX_CHUNK 16384 /* bytes per run of the inner or outer decoder */
+#define MUX_SLACK 4096 /* what the inner decoder might have held back */
+
+/* A ring buffer, written by one thread and read by another. */
+typedef struct mux_ring {
+	uint8_t *buf;
+	int64_t size; /* a power of 2 */
+	int64_t head; /* bytes written */
+	int64_t tail; /* bytes read */
+} mux_ring_t;
+
+typedef struct multi multi_t;
+
+typedef struct mux {
+	multi_t *multi;
+	int id;
+	const char *input;
+	const char *dest;
+	int fd;
+
+	/* The reader thread waits on space for room in samples. */
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+
+	mux_ring_t samples;
+	mux_ring_t bits;
+	mux_ring_t bytes;
+
+	/* Each stage sets its flag when it has passed on everything it
+	 * ever will.  */
+	int eof;
+	int demod_done;
+	int inner_done;
+	int outer_done;
+
+	ofdm_state_t ofdm;
+	int rate; /* code rate from TPS, or -1 */
+
+	viterbi_t vit;
+	int vit_rate; /* that vit was set up for, or -1 */
+
+	outer_decoder_t od;
+	ts_sink_t sink;
+
+	workpool_task_t demod;
+	workpool_task_t inner;
+	workpool_task_t outer;
+
+	/* Statistics */
+	int64_t nsamples; /* into the demodulator */
+	int64_t symbols;
+	int64_t packets; /* out to the sink */
+	int64_t overruns; /* decoded bytes with nowhere to go */
+
+	/* As of the last report */
+	int64_t last_samples;
+	int64_t last_packets;
+	int64_t last_cpu_ns;
+} mux_t;
+
+struct multi {
+	workpool_t pool;
+	mux_t *muxes;
+	int nmux;
+	int soft;
+	int verbose;
+
+	pthread_mutex_t lock; /* main waits on done for every mux to finish */
+	pthread_cond_t done;
+	int ndone;
+};
+
+static int mux_ring_init(mux_ring_t *r, int64_t size) {
+	memset(r, 0, sizeof(*r));
+	r->buf = malloc(size);
+	r->size = size;
+	return r->buf ? 0 : -1;
+}
+
+static int64_t mux_ring_fill(mux_ring_t *r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static int64_t mux_ring_space(mux_ring_t *r) {
+	return r->size - mux_ring_fill(r);
+}
+
+/* Only once there's room for it. */
+static void mux_ring_put(mux_ring_t *r, const void *p, int64_t n) {
+	int64_t head = r->head, ofs = head & (r->size - 1);
+	int64_t first = n < r->size - ofs ? n : r->size - ofs;
+
+	assert(n <= mux_ring_space(r));
+	memcpy(r->buf + ofs, p, first);
+	memcpy(r->buf, (const uint8_t *)p + first, n - first);
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+}
+
+/* Only once it's all there. */
+static void mux_ring_get(mux_ring_t *r, void *p, int64_t n) {
+	int64_t tail = r->tail, ofs = tail & (r->size - 1);
+	int64_t first = n < r->size - ofs ? n : r->size - ofs;
+
+	assert(n <= mux_ring_fill(r));
+	memcpy(p, r->buf + ofs, first);
+	memcpy((uint8_t *)p + first, r->buf, n - first);
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+}
+
+/* The demodulator only runs once a whole symbol's worth is waiting, so
+ * this never has to.  */
+static void mux_input(void *priv, int n, fftw_complex *out) {
+	mux_t *m = priv;
+
+	mux_ring_get(&m->samples, out, n * sizeof(fftw_complex));
+	__atomic_add_fetch(&m->nsamples, n, __ATOMIC_RELAXED);
+}
+
+static void mux_bits(void *priv, const uint8_t *buf, int len) {
+	mux_t *m = priv;
+	ofdm_state_t *ofdm = &m->ofdm;
+
+	__atomic_store_n(&m->rate, ofdm->constel_lp ? ofdm->tps_code_lp : ofdm->tps_code_hp, __ATOMIC_RELEASE);
+	mux_ring_put(&m->bits, buf, len);
+}
+
+static void mux_bytes(void *priv, const uint8_t *buf, int len) {
+	mux_t *m = priv;
+
+	if (len > mux_ring_space(&m->bytes)) {
+		m->overruns += len;
+		return;
+	}
+	mux_ring_put(&m->bytes, buf, len);
+}
+
+static void mux_ts(void *priv, uint8_t *buf, int len) {
+	mux_t *m = priv;
+
+	__atomic_add_fetch(&m->packets, len / OUTER_TS, __ATOMIC_RELAXED);
+	ts_sink_push(&m->sink, buf, len);
+}
+
+static int mux_demod(workpool_task_t *t) {
+	mux_t *m = t->priv;
+	workpool_t *pool = &m->multi->pool;
+	int eof = __atomic_load_n(&m->eof, __ATOMIC_ACQUIRE);
+
+	if (mux_ring_fill(&m->samples) < MUX_SYMBOL_NEED) {
+		/* Whatever's left isn't enough for a symbol. */
+		if (eof && !m->demod_done) {
+			__atomic_store_n(&m->demod_done, 1, __ATOMIC_RELEASE);
+			workpool_wake(pool, &m->inner);
+		}
+		return 0;
+	}
+	if (mux_ring_space(&m->bits) < MUX_SYMBOL_BITS)
+		return 0; /* the inner decoder wakes us when there is */
+
+	ofdm_symbol(&m->ofdm);
+	m->symbols++;
+
+	pthread_mutex_lock(&m->lock);
+	pthread_cond_signal(&m->space);
+	pthread_mutex_unlock(&m->lock);
+	if (mux_ring_fill(&m->bits))
+		workpool_wake(pool, &m->inner);
+	return 1;
+}
+
+static int mux_inner(workpool_task_t *t) {
+	mux_t *m = t->priv;
+	workpool_t *pool = &m->multi->pool;
+	int done = __atomic_load_n(&m->demod_done, __ATOMIC_ACQUIRE);
+	int64_t n = mux_ring_fill(&m->bits);
+	int64_t space = mux_ring_space(&m->bytes);
+	uint8_t buf[MUX_CHUNK];
+	int rate;
+
+	if (space < MUX_CHUNK + MUX_SLACK)
+		return 0; /* the outer decoder wakes us when there is */
+
+	if (!n) {
+		if (done && !m->inner_done) {
+			if (m->vit_rate >= 0)
+				(void) viterbi_flush(&m->vit);
+			__atomic_store_n(&m->inner_done, 1, __ATOMIC_RELEASE);
+			workpool_wake(pool, &m->outer);
+		}
+		return 0;
+	}
+
+	/* The demodulator may be waiting for this space; it may also have
+	 * looked just before we made it, so it has to be woken every time.
+	 * If it's already queued, that costs nothing.  */
+	if (n > MUX_CHUNK)
+		n = MUX_CHUNK;
+	mux_ring_get(&m->bits, buf, n);
+	workpool_wake(pool, &m->demod);
+
+	/* Bits only come out once TPS has locked, and the code rate with
+	 * them; it only changes if the transmitter is reconfigured.  */
+	rate = __atomic_load_n(&m->rate, __ATOMIC_ACQUIRE);
+	if (rate != m->vit_rate) {
+		if (m->vit_rate >= 0) {
+			(void) viterbi_flush(&m->vit);
+			viterbi_free(&m->vit);
+		}
+		m->vit_rate = -1;
+		if (viterbi_init(&m->vit, rate, m->multi->soft, mux_bytes, m) < 0) {
+			fprintf(stderr, "mux %d (%s): no memory for the inner decoder\n", m->id, m->input);
+			return 1; /* drop these bits, and try again with the next */
+		}
+		m->vit.log = m->ofdm.log;
+		m->vit_rate = rate;
+	}
+	if (m->multi->soft)
+		viterbi_push_llrs(&m->vit, (int8_t *)buf, n);
+	else
+		viterbi_push_bits(&m->vit, buf, n);
+
+	if (mux_ring_fill(&m->bytes))
+		workpool_wake(pool, &m->outer);
+	return 1;
+}
+
+static int mux_outer(workpool_task_t *t) {
+	mux_t *m = t->priv;
+	multi_t *multi = m->multi;
+	int done = __atomic_load_n(&m->inner_done, __ATOMIC_ACQUIRE);
+	int64_t n = mux_ring_fill(&m->bytes);
+	uint8_t buf[MUX_CHUNK];
+
+	if (!n) {
+		if (done && !m->outer_done) {
+			ts_sink_flush(&m->sink);
+			m->outer_done = 1;
+			pthread_mutex_lock(&multi->lock);
+			multi->ndone++;
+			pthread_cond_signal(&multi->done);
+			pthread_mutex_unlock(&multi->lock);
+		}
+		return 0;
+	}
+
+	/* As in mux_inner: always wake the stage before us. */
+	if (n > MUX_CHUNK)
+		n = MUX_CHUNK;
+	mux_ring_get(&m->bytes, buf, n);
+	workpool_wake(&multi->pool, &m->inner);
+
+	outer_decoder_push(&m->od, buf, n);
+	return 1;
+}
+
+/* Raw input, two doubles per sample, into the ring as fast as the
+ * demodulator takes it.  */
+static void *mux_reader(void *priv) {
+	mux_t *m = priv;
+	uint8_t buf[65536];
+	int have = 0;
+	ssize_t len;
+
+	while ((len = read(m->fd, buf + have, sizeof(buf) - have)) > 0) {
+		int whole;
+
+		have += len;
+		whole = have - have % sizeof(fftw_complex);
+
+		pthread_mutex_lock(&m->lock);
+		while (mux_ring_space(&m->samples) < whole)
+			pthread_cond_wait(&m->space, &m->lock);
+		pthread_mutex_unlock(&m->lock);
+
+		mux_ring_put(&m->samples, buf, whole);
+		have -= whole;
+		memmove(buf, buf + whole, have);
+		workpool_wake(&m->multi->pool, &m->demod);
+	}
+	if (len < 0)
+		perror(m->input);
+
+	__atomic_store_n(&m->eof, 1, __ATOMIC_RELEASE);
+	workpool_wake(&m->multi->pool, &m->demod);
+	return NULL;
+}
+
+/* Take "input=output" apart, and set up everything for it.  Returns 0, or
+ * -1 if there's no output, or the input or output couldn't be opened.  */
+static int mux_init(mux_t *m, multi_t *multi, int id, char *arg, const ofdm_params_t *fft, const char *pids) {
+	char *eq = strchr(arg, '=');
+
+	memset(m, 0, sizeof(*m));
+	m->multi = multi;
+	m->id = id;
+	m->input = arg;
+	if (!eq) {
+		fprintf(stderr, "%s: no output given\n", arg);
+		return -1;
+	}
+	*eq = 0;
+	m->dest = eq + 1;
+	m->rate = m->vit_rate = -1;
+
+	m->fd = strcmp(m->input, "-") ? open(m->input, O_RDONLY) : 0;
+	if (m->fd < 0) {
+		perror(m->input);
+		return -1;
+	}
+	if (ts_sink_open(&m->sink, m->dest) < 0)
+		return -1;
+	if (pids && ts_sink_allow_list(&m->sink, pids) < 0) {
+		fprintf(stderr, "bad PID list %s\n", pids);
+		return -1;
+	}
+	if (mux_ring_init(&m->samples, MUX_SAMPLES_SZ) < 0 || mux_ring_init(&m->bits, MUX_BITS_SZ) < 0 ||
+	    mux_ring_init(&m->bytes, MUX_BYTES_SZ) < 0)
+		return -1;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->space, NULL);
+
+	ofdm_init(&m->ofdm, fft, mux_input, m, mux_bits, m);
+	m->ofdm.constel_soft = multi->soft;
+	if (multi->verbose)
+		m->ofdm.log = stderr;
+	outer_decoder_init(&m->od, mux_ts, m);
+
+	workpool_task_init(&m->demod, mux_demod, m);
+	workpool_task_init(&m->inner, mux_inner, m);
+	workpool_task_init(&m->outer, mux_outer, m);
+	return 0;
+}
+
+static void mux_free(mux_t *m) {
+	ts_sink_close(&m->sink);
+	if (m->fd > 0)
+		close(m->fd);
+	ofdm_free(&m->ofdm);
+	if (m->vit_rate >= 0)
+		viterbi_free(&m->vit);
+	free(m->samples.buf);
+	free(m->bits.buf);
+	free(m->bytes.buf);
+	pthread_mutex_destroy(&m->lock);
+	pthread_cond_destroy(&m->space);
+}
+
+static double multi_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int64_t mux_cpu_ns(mux_t *m) {
+	return __atomic_load_n(&m->demod.cpu_ns, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&m->inner.cpu_ns, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&m->outer.cpu_ns, __ATOMIC_RELAXED);
+}
+
+/* Per mux, over the time since the last report: throughput in and out,
+ * how much is queued up at each stage, and its share of the CPU time the
+ * pool spent on all of them.  */
+static void multi_report(multi_t *multi, double secs) {
+	int64_t total = 0;
+
+	for (int i = 0; i < multi->nmux; i++)
+		total += mux_cpu_ns(&multi->muxes[i]) - multi->muxes[i].last_cpu_ns;
+
+	for (int i = 0; i < multi->nmux; i++) {
+		mux_t *m = &multi->muxes[i];
+		int64_t samples = __atomic_load_n(&m->nsamples, __ATOMIC_RELAXED);
+		int64_t packets = __atomic_load_n(&m->packets, __ATOMIC_RELAXED);
+		int64_t cpu = mux_cpu_ns(m);
+		int rate = __atomic_load_n(&m->rate, __ATOMIC_RELAXED);
+
+		fprintf(stderr, "mux %d (%s): %.2f Msamples/s in, %.2f Mbit/s TS out; "
+		        "queued %.0f k samples, %.0f KB bits, %.0f KB bytes; "
+		        "%.2f CPUs, %.0f%% of the total; %s\n",
+		        m->id, m->input, (samples - m->last_samples) / secs * 1e-6,
+		        (packets - m->last_packets) * OUTER_TS * 8.0 / secs * 1e-6,
+		        mux_ring_fill(&m->samples) / (double)sizeof(fftw_complex) * 1e-3,
+		        mux_ring_fill(&m->bits) / 1024.0, mux_ring_fill(&m->bytes) / 1024.0,
+		        (cpu - m->last_cpu_ns) * 1e-9 / secs,
+		        total ? 100.0 * (cpu - m->last_cpu_ns) / total : 0.0,
+		        rate >= 0 ? viterbi_rate_name(rate) : "no TPS lock");
+		m->last_samples = samples;
+		m->last_packets = packets;
+		m->last_cpu_ns = cpu;
+	}
+
+	for (int i = 0; i < multi->pool.nthreads; i++) {
+		workpool_worker_t *w = &multi->pool.workers[i];
+
+		fprintf(stderr, "  worker %d: %lld runs, %lld stolen, %.1f s CPU\n", i,
+		        (long long)__atomic_load_n(&w->runs, __ATOMIC_RELAXED),
+		        (long long)__atomic_load_n(&w->steals, __ATOMIC_RELAXED),
+		        __atomic_load_n(&w->cpu_ns, __ATOMIC_RELAXED) * 1e-9);
+	}
+}
+
+int main(int argc, char **argv) {
+	static multi_t multi;
+	const char *pids = NULL;
+	int threads = 0, start_8k = 0, interval = 10;
+	double last;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "svj:8p:i:")) != -1) {
+		switch (opt) {
+		case 's':
+			multi.soft = 1;
+			break;
+		case 'v':
+			multi.verbose = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case '8':
+			start_8k = 1;
+			break;
+		case 'p':
+			pids = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc || interval <= 0) {
+	usage:
+		fprintf(stderr, "usage: %s [-s] [-v] [-8] [-j threads] [-p pid,...] [-i secs] input=output ...\n", argv[0]);
+		fprintf(stderr, "  -s: soft decision decoding\n");
+		fprintf(stderr, "  -v: report sync and TPS changes on stderr\n");
+		fprintf(stderr, "  -8: start looking for 8k signals, rather than 2k\n");
+		fprintf(stderr, "  -j: worker threads (default: one per CPU)\n");
+		fprintf(stderr, "  -p: only pass on these PIDs\n");
+		fprintf(stderr, "  -i: seconds between statistics reports (default 10)\n");
+		fprintf(stderr, "  input: raw samples, as for ofdmvis; - for stdin\n");
+		fprintf(stderr, "  output: file or pipe to write to, udp:PORT for 127.0.0.1, or - for stdout (one mux only)\n");
+		return 1;
+	}
+
+	multi.nmux = argc - optind;
+	multi.muxes = malloc(multi.nmux * sizeof(mux_t));
+	if (!multi.muxes)
+		return 1;
+	pthread_mutex_init(&multi.lock, NULL);
+	pthread_cond_init(&multi.done, NULL);
+	for (int i = 0; i < multi.nmux; i++) {
+		if (mux_init(&multi.muxes[i], &multi, i, argv[optind + i], ofdm_params_for_mode(start_8k), pids) < 0)
+			return 1;
+		for (int j = 0; j < i; j++)
+			if (!strcmp(multi.muxes[i].dest, "-") && !strcmp(multi.muxes[j].dest, "-")) {
+				fprintf(stderr, "%s: only one mux can write to stdout\n", argv[0]);
+				return 1;
+			}
+	}
+
+	if (workpool_init(&multi.pool, threads) < 0) {
+		fprintf(stderr, "%s: couldn't start the workers\n", argv[0]);
+		return 1;
+	}
+	fprintf(stderr, "%d muxes on %d workers.\n", multi.nmux, multi.pool.nthreads);
+
+	for (int i = 0; i < multi.nmux; i++)
+		pthread_create(&multi.muxes[i].reader, NULL, mux_reader, &multi.muxes[i]);
+
+	last = multi_now();
+	pthread_mutex_lock(&multi.lock);
+	while (multi.ndone < multi.nmux) {
+		struct timespec ts;
+		double now;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval;
+		if (pthread_cond_timedwait(&multi.done, &multi.lock, &ts) != ETIMEDOUT)
+			continue;
+
+		pthread_mutex_unlock(&multi.lock);
+		now = multi_now();
+		multi_report(&multi, now - last);
+		last = now;
+		pthread_mutex_lock(&multi.lock);
+	}
+	pthread_mutex_unlock(&multi.lock);
+
+	for (int i = 0; i < multi.nmux; i++)
+		pthread_join(multi.muxes[i].reader, NULL);
+	multi_report(&multi, multi_now() - last);
+	workpool_destroy(&multi.pool);
+
+	for (int i = 0; i < multi.nmux; i++) {
+		mux_t *m = &multi.muxes[i];
+
+		fprintf(stderr, "mux %d (%s): %lld symbols; ", m->id, m->input, (long long)m->symbols);
+		fprintf(stderr, "RS: %lld packets: %lld corrected (%lld bytes), %lld uncorrectable; ",
+		        (long long)m->od.rs_packets, (long long)m->od.rs_corrected,
+		        (long long)m->od.rs_symbols, (long long)m->od.rs_failed);
+		if (m->overruns)
+			fprintf(stderr, "%lld bytes overran; ", (long long)m->overruns);
+		ts_sink_report(&m->sink);
+		mux_free(m);
+	}
+	return 0;
+}
@@ -2,12 +2,22 @@
 #define _DVBT_H
 
 #include "math.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <fftw3.h>
 #include <complex.h>
-#include <SDL2/SDL.h>
 
-#define MAX_CARRIERS 1705
-#define MAX_TPS_CARRIERS 18
+/* libdvbt: the demodulator.  The tables that every receiver shares are
+ * built once, by whichever receiver gets there first, and never change
+ * after that; everything else lives in an ofdm_state_t, so there can be as
+ * many receivers as there are muxes, on as many threads.  Samples come in,
+ * and bits go out, through callbacks.  */
+
+#define MAX_CARRIERS 6817 /* 8k mode */
+#define MAX_TPS_CARRIERS 69
+#define DVBT_MAX_CELLS 6048 /* data cells per symbol, for 8k mode */
+#define DVBT_LLR_GAIN 8.0f /* soft bit units per unit of squared lattice distance */
 
 /* Convert a normal carrier number (by the specification) into am offset
  * into the FFT results.
@@ -20,33 +30,74 @@
 
 typedef struct ofdm_params {
 	int size;
+	int mode; /* as signalled in TPS: 0 for 2k, 1 for 8k */
 	int *tps_carriers;
 	int *continual_pilots;
 	int k_min_ofs;
 	int k_max;
 	int n_max;
 	uint16_t *scram_h;
+	int scram_bits; /* width of the H(q) register, N_r - 1 */
+	int *scram_perm; /* R[scram_perm[b]] = R'[b] */
+	uint16_t scram_taps; /* feedback taps of R' */
+	
+	/* Carrier classification, built by ofdm_init_constants() for each
+	 * value of (symbol % 4).  data_carriers and data_bins have n_max
+	 * entries each: the carrier number of each data cell, in order, and
+	 * where to find it in the FFT output.  scattered_pilots is
+	 * terminated by -1, like the other carrier lists.  */
+	int *data_carriers[4];
+	int *data_bins[4];
+	int *scattered_pilots[4];
+	
+	/* Combined deinterleaver permutations, built by
+	 * ofdm_init_deinterleave(); [constellation][hierarchical][symbol % 2].  */
+	uint16_t *deint[3][2][2];
 } ofdm_params_t;
 
+/* Fill out with the next n samples, waiting for them if need be. */
+typedef void (*ofdm_input_t)(void *priv, int n, fftw_complex *out);
+
+/* One symbol's worth of deinterleaved bits: packed (first bit in bit 7),
+ * or one int8 LLR per bit if constel_soft is set.  */
+typedef void (*ofdm_output_t)(void *priv, const uint8_t *buf, int len);
+
 enum dvbt_constellation {
 	CONSTEL_QPSK = 0,
 	CONSTEL_QAM16 = 1,
 	CONSTEL_QAM64 = 2
 };
 
+/* Per-constellation demapping tables; see dvbt_demap.c. */
+typedef struct dvbt_demap {
+	int bits; /* bits per cell */
+	int hp_bits; /* bits per cell in the HP stream; == bits if not hierarchical */
+	double scale; /* equalized cell -> constellation lattice */
+	int nlevels; /* levels per axis */
+	double thresh[7]; /* decision thresholds between levels, ascending */
+	float level[8]; /* the levels themselves, on the lattice */
+	uint8_t code[8]; /* axis bits for each level, sign bit first */
+	uint8_t sym[8][8]; /* [Re level][Im level] -> {y0, y1, ... y(v-1)} */
+	uint8_t demux[6]; /* interleaver (b_e) for each input bit, HP first */
+} dvbt_demap_t;
+
 typedef struct ofdm_state {
 	/* Parameters */
-	ofdm_params_t *fft;
+	const ofdm_params_t *fft;
+	const ofdm_params_t *fft_next; /* switch to this before the next symbol */
+	int mode_auto; /* hunt between 2k and 8k until TPS locks */
+	FILE *log; /* sync and TPS news, if anyone wants it; NULL by default */
 	int guard_len; /* guard length */
 	/* Changing either of these parameters requires a cleanup and
 	 * resynchronization.  */
 	 
 	double snr;
 	
-	/* Sample receiver */
-	int cursamp;
-	int nsamples;
-	double *samples;
+	/* Sample source and bit sink */
+	ofdm_input_t input;
+	void *input_priv;
+	ofdm_output_t output;
+	void *output_priv;
 	
 	/* Estimator */
 	double estim_confidence; /* How good the estimator is feeling. */
@@ -58,28 +109,37 @@ typedef struct ofdm_state {
 	fftw_plan fft_plan;
 	fftw_complex *fft_in;
 	fftw_complex *fft_out;
-	int fft_symcount;
-	int fft_dbg_carrier;
-	SDL_Surface *fft_surf;
 	
-	SDL_Surface *master;
+	/* CPE */
+	int cpe_enabled;
+	double cpe_phase; /* rotation taken out of the last symbol */
 	
 	/* EQ */
-	double eq_phase[MAX_CARRIERS];
-	double eq_ampl[MAX_CARRIERS];
-	SDL_Surface *eq_surf;
+	double *eq_phase; /* k_max + 1 of each, for the current mode */
+	double *eq_ampl;
+	int eq_valid; /* eq_phase and eq_ampl hold a full estimate */
+	int eq_adaptive; /* only reinterpolate when the pilots have drifted */
+	double eq_threshold; /* residual energy, relative to pilot energy */
+	double eq_residual; /* residual energy seen on the last symbol */
+	int eq_symbols; /* symbols equalized ... */
+	int eq_full_updates; /* ... and how many of those reinterpolated */
 	
 	/* TPS */
 #define TPS_N_BITS 68
-#define TPS_SYNCBIT 17 /* bit that you carry on after synchronizing */
 #define TPS_SYNC 0x35EE
+#define TPS_HUNT_SYMBOLS (3 * TPS_N_BITS) /* try the other mode after this long */
+#define TPS_MAX_BAD 2 /* bad frames in a row before we drop sync */
 	int tps_bit; /* next TPS bit */
-	uint8_t tps_rx[9];
-	uint16_t tps_lastrx; /* for storing synchronization state */
+	int tps_hunt; /* symbols since we last had TPS sync */
+	int tps_bad; /* frames in a row that failed to decode */
+	uint8_t tps_rx[9]; /* last good frame, corrected */
+	uint8_t tps_hist[TPS_N_BITS]; /* the last 68 bits received, newest last */
 	double complex tps_last[MAX_TPS_CARRIERS];
 	
 	enum dvbt_constellation tps_constellation;
-	int tps_hierarchy;
+	int tps_hierarchy; /* 0: none, 1-3: alpha = 1, 2, 4 */
+	int tps_code_hp; /* 0-4: code rate 1/2, 2/3, 3/4, 5/6, 7/8 */
+	int tps_code_lp; /* only meaningful if hierarchical */
 
 	/* Current frame-level TPS state output */
 	int tps_synchronized;
@@ -88,26 +148,40 @@ typedef struct ofdm_state {
 	
 	/* Constellation demod and deinterleave */
 	int constel_ready;
+	int constel_check_pilots; /* also sanity check pilots and TPS */
+	int constel_lp; /* in hierarchical modes, output the LP stream */
+	int constel_soft; /* output int8 LLRs, one per bit, instead of packed bits */
 	
 } ofdm_state_t;
 
-#define DEBUG_XRES 240
-#define DEBUG_YRES 240
+extern const ofdm_params_t *ofdm_params_for_mode(int mode);
+extern const char *const dvbt_prbs;
+extern void ofdm_init_constants();
 
-extern uint32_t hsvtorgb(float H, float S, float V);
+extern void ofdm_set_mode(ofdm_state_t *ofdm, const ofdm_params_t *fft);
 
-extern ofdm_params_t ofdm_params_2048;
-extern char dvbt_prbs[8192];
-extern void ofdm_init_constants();
+extern pthread_mutex_t ofdm_fftw_lock;
+#define OFDM_LOG(ofdm, ...) do { if ((ofdm)->log) fprintf((ofdm)->log, __VA_ARGS__); } while (0)
+extern void ofdm_init(ofdm_state_t *ofdm, const ofdm_params_t *fft, ofdm_input_t input, void *input_priv,
+                      ofdm_output_t output, void *output_priv);
+extern void ofdm_symbol(ofdm_state_t *ofdm);
+extern void ofdm_free(ofdm_state_t *ofdm);
 
-extern void ofdm_getsamples(ofdm_state_t *ofdm, int nreq, fftw_complex *out);
 extern void ofdm_estimate_symbol(ofdm_state_t *ofdm);
 
+extern void ofdm_cpe(ofdm_state_t *ofdm);
+
 extern void ofdm_eq(ofdm_state_t *ofdm);
-extern void ofdm_eq_debug(ofdm_state_t *ofdm);
 
+extern void ofdm_init_tps();
 extern void ofdm_tps(ofdm_state_t *ofdm);
 
+extern void ofdm_init_demap();
+extern const dvbt_demap_t *dvbt_demap(enum dvbt_constellation constel, int hierarchy);
+extern void dvbt_demap_hard(const dvbt_demap_t *d, const float *re, const float *im, int n, uint8_t *ys);
+extern void dvbt_demap_soft(const dvbt_demap_t *d, const float *re, const float *im, const float *csi, int n, int8_t *llrs);
+
+extern void ofdm_init_deinterleave(ofdm_params_t *p);
 extern void ofdm_constel(ofdm_state_t *ofdm);
 
 #endif
@@ -1,4 +1,7 @@
 /* Symbol estimation, as per [Beek97]. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "dvbt.h"
 
 void ofdm_estimate_symbol(ofdm_state_t *ofdm)
@@ -28,7 +31,7 @@ void ofdm_estimate_symbol(ofdm_state_t *ofdm)
 	 * beginning of the buffer for next time.
 	 */
 	
-	ofdm_getsamples(ofdm, 2*N + L - ofdm->estim_refill, ofdm->estim_buf + ofdm->estim_refill);
+	ofdm->input(ofdm->input_priv, 2*N + L - ofdm->estim_refill, ofdm->estim_buf + ofdm->estim_refill);
 
 	/* Prime the running sums. */
 	double complex gam = 0, Phi = 0;
@@ -58,7 +61,7 @@ void ofdm_estimate_symbol(ofdm_state_t *ofdm)
 		
 		gam -= GAM(k);
 		Phi -= PHI(k);
-		if (k != (2*N-1))
+		if (k + L + N < 2*N + L) /* the end of the buffer */
 		{
 			gam += GAM(k+L);
 			Phi += PHI(k+L);
@@ -89,7 +92,7 @@ void ofdm_estimate_symbol(ofdm_state_t *ofdm)
 			argmax = L - CONFIDENCE_WIDTH;
 		if (confident && argmax > (L + CONFIDENCE_WIDTH))
 			argmax = L + CONFIDENCE_WIDTH;
-		printf("estimator is feeling a little nervous, new argmax is %d...\n", argmax);
+		OFDM_LOG(ofdm, "estimator is feeling a little nervous, new argmax is %d...\n", argmax);
 	}
 
 	double epsilon = (-1.0 / (2.0 * M_PI)) * carg(bestgam);
@@ -1,8 +1,100 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "dvbt.h"
 
 #define LOUD(s...)
 //#define LOUD(s...) printf(s)
 
+/* Pilots and TPS carriers should all land on the real axis with a known
+ * magnitude once equalized; count the ones that don't.  */
+static int ofdm_constel_check_pilots(ofdm_state_t *ofdm)
+{
+	int odd_pilots = 0;
+	int i, c;
+	
+#define EQUALIZED(c) ({ \
+		double complex _cur; \
+		_cur = ofdm->fft_out[CARRIER(ofdm, c)][0] + \
+		       ofdm->fft_out[CARRIER(ofdm, c)][1]*1i; \
+		_cur *= cexp(-ofdm->eq_phase[c]*1i); \
+		_cur /= ofdm->eq_ampl[c]; \
+		_cur; })
+
+	for (i = 0; (c = ofdm->fft->continual_pilots[i]) != -1; i++) {
+		double complex cur = EQUALIZED(c);
+		double re = creal(cur), im = cimag(cur);
+		if (im > 0.3 || im < -0.3 || re * 2.0 * (0.5 - dvbt_prbs[c]) < 1.0) {
+			LOUD("constel: continual pilot %d seems odd (re %lf, im %lf)\n", c, re, im);
+			odd_pilots++;
+		}
+	}
+	
+	for (i = 0; (c = ofdm->fft->tps_carriers[i]) != -1; i++) {
+		double complex cur = EQUALIZED(c);
+		double re = creal(cur), im = cimag(cur);
+		if (im > 0.3 || im < -0.3 || fabs(re) < 0.7) {
+			LOUD("constel: tps %d seems odd (re %lf, im %lf)\n", c, re, im);
+			odd_pilots++;
+		}
+	}
+	
+	for (i = 0; (c = ofdm->fft->scattered_pilots[ofdm->symbol % 4][i]) != -1; i++) {
+		double complex cur = EQUALIZED(c);
+		double re = creal(cur), im = cimag(cur);
+		if (im > 0.3 || im < -0.3 || re * 2.0 * (0.5 - dvbt_prbs[c]) < 1.0) {
+			LOUD("constel: scattered pilot %d for symbol %d seems odd (re %lf, im %lf)\n", c, ofdm->symbol, re, im);
+			odd_pilots++;
+		}
+	}
+#undef EQUALIZED
+	
+	return odd_pilots;
+}
+
+/* Section 4.3.4 in one go: undo the symbol interleaver, the bit
+ * interleaver, and the demux, for both the even and odd symbol variants.
+ * Entry k of a table is where the k'th bit of output (HP stream first, then
+ * LP) comes from in the demapper's output, as cell * bits + bit.  */
+void ofdm_init_deinterleave(ofdm_params_t *p)
+{
+	const int Hk[] = {0, 63, 105, 42, 21, 84}; /* bit interleaver, figure 7a */
+	uint16_t hinv[DVBT_MAX_CELLS];
+	int q;
+	
+	for (q = 0; q < p->n_max; q++)
+		hinv[p->scram_h[q]] = q;
+	
+	for (int constel = CONSTEL_QPSK; constel <= CONSTEL_QAM64; constel++)
+		for (int hier = 0; hier < 2; hier++) {
+			const dvbt_demap_t *d = dvbt_demap(constel, hier);
+			if (!d)
+				continue;
+			
+			for (int odd = 0; odd < 2; odd++) {
+				uint16_t *perm = malloc(sizeof(uint16_t) * p->n_max * d->bits);
+				int k = 0;
+				assert(perm);
+				
+				for (int stream = 0; stream < 2; stream++) {
+					int e0 = stream ? d->hp_bits : 0;
+					int e1 = stream ? d->bits : d->hp_bits;
+					
+					for (int w = 0; w < p->n_max; w++)
+						for (int e = e0; e < e1; e++) {
+							int ee = d->demux[e];
+							int wp = (w + 126 - Hk[ee]) % 126 + w / 126 * 126;
+							int cell = odd ? hinv[wp] : p->scram_h[wp];
+							perm[k++] = cell * d->bits + ee;
+						}
+				}
+				
+				p->deint[constel][hier][odd] = perm;
+			}
+		}
+}
+
 void ofdm_constel(ofdm_state_t *ofdm)
 {
 	if (!ofdm->tps_synchronized) {
@@ -16,139 +108,89 @@ void ofdm_constel(ofdm_state_t *ofdm)
 	}
 	ofdm->constel_ready = 1;
 	
-	int tps_c = 0;
-	int pilot_c = 0;
-	int odd_pilots = 0;
-	int c;
-	
-	uint8_t ys[6048]; /* max for 8k mode */
-	int yptr = 0;
-	int ybits = 0;
-	
-	for (c = 0; c <= ofdm->fft->k_max; c++) {
-		double complex cur;
-		cur = ofdm->fft_out[CARRIER(ofdm, c)][0] +
-		      ofdm->fft_out[CARRIER(ofdm, c)][1]*1i;
-		cur *= cexp(-ofdm->eq_phase[c]*1i);
-		cur /= ofdm->eq_ampl[c];
-	
-		double re = creal(cur);
-		double im = cimag(cur);
-		
-		/* Skip pilots. */
-		if (c == ofdm->fft->continual_pilots[pilot_c]) {
-			pilot_c++;
-			if (im > 0.3 || im < -0.3 || re * 2.0 * (0.5 - dvbt_prbs[c]) < 1.0) {
-				LOUD("constel: continual pilot %d seems odd (re %lf, im %lf)\n", c, re, im);
-				odd_pilots++;
-			}
-			continue;
+	if (ofdm->constel_check_pilots) {
+		int odd_pilots = ofdm_constel_check_pilots(ofdm);
+		if (odd_pilots > 10) {
+			OFDM_LOG(ofdm, "constel: symbol %d had %d pilots that seemed suspicious\n", ofdm->symbol, odd_pilots);
 		}
-		
-		if (c == ofdm->fft->tps_carriers[tps_c]) {
-			tps_c++;
-			if (im > 0.3 || im < -0.3 || fabs(re) < 0.7) {
-				LOUD("constel: tps %d seems odd (re %lf, im %lf)\n", c, re, im);
-				odd_pilots++;
-			}
-			continue;
-		}
-		
-		if ((c + 12 - 3 * (ofdm->symbol % 4)) % 12 == 0) {
-			if (im > 0.3 || im < -0.3 || re * 2.0 * (0.5 - dvbt_prbs[c]) < 1.0) {
-				LOUD("constel: scattered pilot %d for symbol %d seems odd (re %lf, im %lf)\n", c, ofdm->symbol, re, im);
-				odd_pilots++;
-			}
-			continue;
-		}
-		
-		uint8_t sym;
-		int symbits;
-		switch (ofdm->tps_constellation) {
-		case CONSTEL_QAM16: {
-			uint8_t ire, iim;
-			
-			/* syms centered on 1.0, 0.33, -0.33, -1.0 */
-			     if (re >  0.66) ire = 0b00;
-			else if (re >  0.00) ire = 0b01;
-			else if (re > -0.66) ire = 0b11;
-			else                 ire = 0b10;
-			
-			     if (im >  0.66) iim = 0b00;
-			else if (im >  0.00) iim = 0b01;
-			else if (im > -0.66) iim = 0b11;
-			else                 iim = 0b10;
-			
-			sym = (ire & 0b10) << 2 | (ire & 0b01) << 1 | (iim & 0b10) << 1 | (iim & 0b01); /* {Y0,q', Y1,q', Y2,q', Y3,q'} */
-			ybits = 4;
-			
-			break;
-		}
-		default:
-			printf("constel: bad constellation %d\n", ofdm->tps_constellation);
-			return;
-		}
-		
-		ys[yptr++] = sym;
 	}
 	
-	if (odd_pilots > 10) {
-		printf("constel: symbol %d had %d pilots that seemed suspicious\n", ofdm->symbol, odd_pilots);
+	const dvbt_demap_t *d = dvbt_demap(ofdm->tps_constellation, ofdm->tps_hierarchy);
+	if (!d) {
+		OFDM_LOG(ofdm, "constel: bad constellation %d\n", ofdm->tps_constellation);
+		return;
 	}
 	
-	if (ofdm->fft->tps_carriers[tps_c] != -1) {
-		printf("constel: missed a TPS carrier\n");
-	}
+	int c;
 	
-	if (ofdm->fft->continual_pilots[pilot_c] != -1) {
-		printf("constel: missed a pilot carrier\n");
-	}
+	uint8_t ys[DVBT_MAX_CELLS];
+	int yptr;
+	int ybits = d->bits;
+	
+	/* Gather and equalize just the data cells; the tables already
+	 * know where they are in this symbol.  */
+	const int *carriers = ofdm->fft->data_carriers[ofdm->symbol % 4];
+	const int *bins = ofdm->fft->data_bins[ofdm->symbol % 4];
+	float res[DVBT_MAX_CELLS], ims[DVBT_MAX_CELLS], csi[DVBT_MAX_CELLS];
+	double csum = 0.0;
 	
-	if (yptr != ofdm->fft->n_max) {
-		printf("constel: unpacked wrong number of Ys %d sym %d should be %d, tps_c %d, pilot_c %d\n", yptr, ofdm->symbol, ofdm->fft->n_max, tps_c, pilot_c);
+	for (yptr = 0; yptr < ofdm->fft->n_max; yptr++) {
+		int k = carriers[yptr];
+		double re = ofdm->fft_out[bins[yptr]][0];
+		double im = ofdm->fft_out[bins[yptr]][1];
+		double pr = cos(ofdm->eq_phase[k]) / ofdm->eq_ampl[k];
+		double pi = -sin(ofdm->eq_phase[k]) / ofdm->eq_ampl[k];
+		res[yptr] = re * pr - im * pi;
+		ims[yptr] = re * pi + im * pr;
+		csi[yptr] = ofdm->eq_ampl[k] * ofdm->eq_ampl[k];
+		csum += csi[yptr];
 	}
 	
-	if (ofdm->symbol == 0 && ofdm->frame == 0) {
-		printf("ys[0] = %x, 1024 = %x, 16 = %x\n", ys[0], ys[1024], ys[16]);
+	/* In hierarchical modes, the HP and LP streams are separate
+	 * transport streams; only hand back the one that was asked for.  */
+	const uint16_t *perm = ofdm->fft->deint[ofdm->tps_constellation][ofdm->tps_hierarchy != 0][ofdm->symbol % 2];
+	int nbits = ofdm->fft->n_max * d->hp_bits;
+	if (d->hp_bits != d->bits && ofdm->constel_lp) {
+		perm += nbits;
+		nbits = ofdm->fft->n_max * (d->bits - d->hp_bits);
 	}
 	
-	/* section 4.3.4.2: symbol deinterleaver */
-	uint8_t yps[6048];
-	for (c = 0; c <= ofdm->fft->k_max; c++) {
-		if ((ofdm->symbol % 2) == 0) {
-			yps[c] = ys[ofdm->fft->scram_h[c]];
-		} else {
-			yps[ofdm->fft->scram_h[c]] = ys[c];
-		}
+	if (ofdm->constel_soft) {
+		int8_t ls[DVBT_MAX_CELLS * 6], xs[DVBT_MAX_CELLS * 6];
+		
+		for (yptr = 0; yptr < ofdm->fft->n_max; yptr++)
+			csi[yptr] *= ofdm->fft->n_max / csum;
+		dvbt_demap_soft(d, res, ims, csi, ofdm->fft->n_max, ls);
+		
+		for (c = 0; c < nbits; c++)
+			xs[c] = ls[perm[c]];
+		
+		if (ofdm->output)
+			ofdm->output(ofdm->output_priv, (const uint8_t *)xs, nbits);
+		return;
 	}
 	
-	/* bitwise interleaver output a_n,w is defined in terms of y'_w */
-	const int Hk[] = {0, 63, 105, 42, 21, 84};
-#define a(n,w) ((yps[w] >> (ybits - (n) - 1)) & 1) /* symbol interleaver, figure 7a */
-#define b(e,w) (a(e, ((w) + 126 - Hk[e]) % 126 + (w) / 126 * 126)) /* bit interleaver, figure 7a */
-
-	/* demux from b[x,y] to x */
-	uint8_t xs[6048 / 8] = {}; /* note that first bit in bit-serial order is bit 7!  i.e., x = {xs[0][7:0], xs[1][7:0], ...} */
-	int bit = 0;
-#define PUTBIT(b) do { \
-		xs[bit / 8] |= (b) << (7 - (bit % 8)); \
-		bit++; \
-	} while(0)
-	
-	for (c = 0; c < ofdm->fft->n_max; c++) {
-		switch (ofdm->tps_constellation) {
-		case CONSTEL_QAM16:
-			PUTBIT(b(0, c));
-			PUTBIT(b(2, c));
-			PUTBIT(b(1, c));
-			PUTBIT(b(3, c));
-			break;
-		default:
-			printf("constel: bad constellation %d\n", ofdm->tps_constellation);
-			return;
-		}
+	dvbt_demap_hard(d, res, ims, ofdm->fft->n_max, ys);
+	
+	/* One byte per bit, so that the permutation can gather bits. */
+	uint8_t ybit[DVBT_MAX_CELLS * 6], xbit[DVBT_MAX_CELLS * 6];
+	for (yptr = 0; yptr < ofdm->fft->n_max; yptr++)
+		for (int e = 0; e < ybits; e++)
+			ybit[yptr * ybits + e] = (ys[yptr] >> (ybits - e - 1)) & 1;
+	
+	for (c = 0; c < nbits; c++)
+		xbit[c] = ybit[perm[c]];
+	
+	/* Pack eight bits at a time; the multiply moves byte j's low bit to
+	 * bit 63 - j, with no carries.  note that first bit in bit-serial
+	 * order is bit 7!  i.e., x = {xs[0][7:0], xs[1][7:0], ...} */
+	uint8_t xs[DVBT_MAX_CELLS * 6 / 8];
+	for (c = 0; c < nbits / 8; c++) {
+		uint64_t v;
+		memcpy(&v, &xbit[c * 8], 8); /* little-endian */
+		xs[c] = (v * 0x8040201008040201ULL) >> 56;
 	}
 	
-	printf("constel: deinterleaved %d bits, xs[0] = %02x\n", bit, xs[0]);
-	write(2, xs, bit/8);
+	if (ofdm->output)
+		ofdm->output(ofdm->output_priv, xs, nbits / 8);
 }
@@ -0,0 +1,45 @@
+/* Common phase error correction. */
+#include "dvbt.h"
+
+/* Residual carrier offset and phase noise turn every carrier in a symbol
+ * by the same amount.  Measure that rotation on the continual pilots,
+ * against what the EQ currently expects them to look like, and take it
+ * back out of the whole symbol before anyone else sees it.  */
+void ofdm_cpe(ofdm_state_t *ofdm)
+{
+	double complex acc = 0;
+	int i;
+	
+	ofdm->cpe_phase = 0.0;
+	if (!ofdm->cpe_enabled || !ofdm->eq_valid)
+		return;
+	
+	for (i = 0; ofdm->fft->continual_pilots[i] != -1; i++) {
+		int c = ofdm->fft->continual_pilots[i];
+		double complex rx, ref;
+		
+		rx = ofdm->fft_out[CARRIER(ofdm, c)][0] +
+		     ofdm->fft_out[CARRIER(ofdm, c)][1]*1i;
+		ref = ofdm->eq_ampl[c] * cexp(ofdm->eq_phase[c]*1i);
+		if (dvbt_prbs[c])
+			ref = -ref;
+		
+		acc += rx * conj(ref);
+	}
+	
+	if (acc == 0)
+		return;
+	
+	ofdm->cpe_phase = carg(acc);
+	
+	/* Rotate every bin by -phase; straight-line, so that it vectorizes. */
+	double cr = cos(ofdm->cpe_phase);
+	double ci = sin(ofdm->cpe_phase);
+	double *bins = &ofdm->fft_out[0][0];
+	for (i = 0; i < ofdm->fft->size * 2; i += 2) {
+		double re = bins[i];
+		double im = bins[i + 1];
+		bins[i]     = re * cr + im * ci;
+		bins[i + 1] = im * cr - re * ci;
+	}
+}
@@ -0,0 +1,181 @@
+/* Table-driven constellation demapper, section 4.3.5. */
+#include <assert.h>
+#include <string.h>
+#include "dvbt.h"
+
+static dvbt_demap_t _demap[3][4];
+
+/* Each axis carries every other bit of the cell: Re has y0, y2, y4, and Im
+ * has y1, y3, y5.  The first bit of an axis is its sign, and the rest are
+ * a Gray code counting inwards from the outermost level.  Hierarchical
+ * modes only move the levels apart from the axis by alpha; the bits stay
+ * the same.  */
+static void ofdm_init_demap_one(dvbt_demap_t *d, int bits, int alpha)
+{
+	int half = 1 << (bits / 2 - 1); /* levels on each side of the axis */
+	int nlevels = half * 2;
+	double level[8];
+	uint8_t code[8];
+	double energy = 0.0;
+	int i;
+	
+	d->bits = bits;
+	d->nlevels = nlevels;
+	
+	for (i = 0; i < half; i++) {
+		int gray = (half - 1 - i) ^ ((half - 1 - i) >> 1);
+		
+		/* levels ascending: -(alpha + 2*(half-1)) ... +(alpha + 2*(half-1)) */
+		level[half + i] = alpha + 2 * i;
+		level[half - 1 - i] = -(alpha + 2 * i);
+		code[half + i] = gray;
+		code[half - 1 - i] = gray | half; /* sign is the top bit */
+		energy += 2.0 * (alpha + 2 * i) * (alpha + 2 * i);
+	}
+	
+	/* Average cell energy is 1 after equalization. */
+	d->scale = sqrt(2.0 * energy / nlevels);
+	
+	for (i = 0; i < nlevels - 1; i++)
+		d->thresh[i] = (level[i] + level[i + 1]) / 2.0;
+	for (i = 0; i < nlevels; i++) {
+		d->level[i] = level[i];
+		d->code[i] = code[i];
+	}
+	
+	/* Interleave the two axes' codes into {y0, y1, ... y(v-1)}. */
+	for (int lr = 0; lr < nlevels; lr++)
+		for (int li = 0; li < nlevels; li++) {
+			uint8_t sym = 0;
+			for (int b = 0; b < bits / 2; b++) {
+				int shift = bits / 2 - 1 - b;
+				sym = (sym << 1) | ((code[lr] >> shift) & 1);
+				sym = (sym << 1) | ((code[li] >> shift) & 1);
+			}
+			d->sym[lr][li] = sym;
+		}
+}
+
+/* Bit demultiplexer, section 4.3.4.1: which interleaver output b_e each
+ * input bit came from, HP stream first.  */
+static void ofdm_init_demux(dvbt_demap_t *d, int hierarchical)
+{
+	static const uint8_t demux_qpsk[] = {0, 1};
+	static const uint8_t demux_16[] = {0, 2, 1, 3};
+	static const uint8_t demux_64[] = {0, 2, 4, 1, 3, 5};
+	static const uint8_t demux_16h[] = {0, 1, 2, 3};
+	static const uint8_t demux_64h[] = {0, 1, 2, 4, 3, 5};
+	const uint8_t *demux;
+	
+	switch (d->bits) {
+	case 2: demux = demux_qpsk; break;
+	case 4: demux = hierarchical ? demux_16h : demux_16; break;
+	default: demux = hierarchical ? demux_64h : demux_64; break;
+	}
+	
+	memcpy(d->demux, demux, d->bits);
+	d->hp_bits = hierarchical ? 2 : d->bits;
+}
+
+void ofdm_init_demap()
+{
+	static const int alphas[4] = {1, 1, 2, 4};
+	
+	for (int constel = CONSTEL_QPSK; constel <= CONSTEL_QAM64; constel++)
+		for (int hier = 0; hier < 4; hier++) {
+			dvbt_demap_t *d = &_demap[constel][hier];
+			
+			/* There is no hierarchical QPSK. */
+			if (constel == CONSTEL_QPSK && hier != 0)
+				continue;
+			
+			ofdm_init_demap_one(d, 2 * (constel + 1), alphas[hier]);
+			ofdm_init_demux(d, hier != 0);
+		}
+}
+
+const dvbt_demap_t *dvbt_demap(enum dvbt_constellation constel, int hierarchy)
+{
+	if (constel < CONSTEL_QPSK || constel > CONSTEL_QAM64 ||
+	    hierarchy < 0 || hierarchy > 3)
+		return NULL;
+	if (_demap[constel][hierarchy].bits == 0)
+		return NULL;
+	return &_demap[constel][hierarchy];
+}
+
+/* Hard decisions for n equalized cells.  Each axis is sliced by counting
+ * the thresholds below it, one threshold at a time across the whole
+ * symbol, so that the compiler can vectorize the compares.  */
+void dvbt_demap_hard(const dvbt_demap_t *d, const float *re, const float *im, int n, uint8_t *ys)
+{
+	uint8_t lre[DVBT_MAX_CELLS], lim[DVBT_MAX_CELLS];
+	float scale = d->scale;
+	int i, j;
+	
+	assert(n <= DVBT_MAX_CELLS);
+	
+	memset(lre, 0, n);
+	memset(lim, 0, n);
+	for (j = 0; j < d->nlevels - 1; j++) {
+		float t = d->thresh[j];
+		for (i = 0; i < n; i++) {
+			lre[i] += (re[i] * scale) > t;
+			lim[i] += (im[i] * scale) > t;
+		}
+	}
+	
+	for (i = 0; i < n; i++)
+		ys[i] = d->sym[lre[i]][lim[i]];
+}
+
+/* Max-log soft decisions for n equalized cells, into llrs[n * bits] in
+ * {y0, y1, ... y(v-1)} order for each cell.  Positive means that 0 is the
+ * more likely bit.  Each axis is handled separately, since the bits on one
+ * axis don't depend on the other: the LLR of a bit is the distance to the
+ * nearest level where it is 1 minus the distance to the nearest level
+ * where it is 0.  Cells are weighted by their CSI -- the channel's power
+ * on that carrier, relative to the rest of the symbol -- since a faded
+ * carrier's noise is magnified by the EQ.  */
+#define DEMAP_CHUNK 64
+
+void dvbt_demap_soft(const dvbt_demap_t *d, const float *re, const float *im, const float *csi, int n, int8_t *llrs)
+{
+	int axbits = d->bits / 2;
+	float scale = d->scale;
+	
+	for (int base = 0; base < n; base += DEMAP_CHUNK) {
+		int len = (n - base < DEMAP_CHUNK) ? n - base : DEMAP_CHUNK;
+		
+		for (int axis = 0; axis < 2; axis++) {
+			const float *x = (axis ? im : re) + base;
+			float m0[3][DEMAP_CHUNK], m1[3][DEMAP_CHUNK];
+			int i, j, k;
+			
+			for (k = 0; k < axbits; k++)
+				for (i = 0; i < len; i++)
+					m0[k][i] = m1[k][i] = INFINITY;
+			
+			for (j = 0; j < d->nlevels; j++) {
+				float l = d->level[j];
+				for (k = 0; k < axbits; k++) {
+					int one = (d->code[j] >> (axbits - 1 - k)) & 1;
+					float *m = one ? m1[k] : m0[k];
+					for (i = 0; i < len; i++) {
+						float dist = (x[i] * scale - l) * (x[i] * scale - l);
+						m[i] = dist < m[i] ? dist : m[i];
+					}
+				}
+			}
+			
+			/* Axis bit k is y(2k) on Re, and y(2k+1) on Im. */
+			for (k = 0; k < axbits; k++)
+				for (i = 0; i < len; i++) {
+					float llr = (m1[k][i] - m0[k][i]) * csi[base + i] * DVBT_LLR_GAIN;
+					if (llr > 127.0f) llr = 127.0f;
+					if (llr < -127.0f) llr = -127.0f;
+					llrs[(base + i) * d->bits + 2 * k + axis] = (int8_t)lrintf(llr);
+				}
+		}
+	}
+}
@@ -1,16 +1,15 @@
 #include "dvbt.h"
 
-static float _eq_iir_coeff = 0.1;
+static const float _eq_iir_coeff = 0.1;
 
-void ofdm_eq(ofdm_state_t *ofdm)
+#define EQ_DEFAULT_THRESHOLD 0.1
+
+static void ofdm_eq_interpolate(ofdm_state_t *ofdm)
 {
 	/* Take a list of pilots, then compute an estimated phase and
 	 * amplitude for each carrier by linear interpolation between
 	 * pilots, and then IIR filter that.  */
 	
-	double phase[MAX_CARRIERS];
-	double ampl[MAX_CARRIERS];
-	
 	int i;
 	for (i = 0; ofdm->fft->continual_pilots[i+1] != -1; i++) {
 		int c0 = ofdm->fft->continual_pilots[i];
@@ -48,13 +47,31 @@ void ofdm_eq(ofdm_state_t *ofdm)
 		a0 *= 3.0 / 4.0;
 		a1 *= 3.0 / 4.0;
 		
-		/* XXX do no IIR */
-		for (int c = c0; c <= c1; c++) {
+		/* Only IIR once CPE has taken the common phase noise out;
+		 * otherwise, the filter would just lag behind it.  */
+		double iir = (ofdm->cpe_enabled && ofdm->eq_valid) ? _eq_iir_coeff : 1.0;
+		
+		/* c1 is the next segment's c0, so don't filter it twice. */
+		int cend = (ofdm->fft->continual_pilots[i+2] == -1) ? c1 : c1 - 1;
+		for (int c = c0; c <= cend; c++) {
 			double k = (double)(c - c0) / (double)(c1 - c0);
 			
-			ofdm->eq_ampl[c] = a1 * k + a0 * (1.0 - k);
+			double a = a1 * k + a0 * (1.0 - k);
+			ofdm->eq_ampl[c] += (a - ofdm->eq_ampl[c]) * iir;
+			
 			double ph = ph1 * k + ph0 * (1.0 - k);
 			/* Normalize phase back away. */
+			if (ph > M_PI)
+				ph -= M_PI * 2.0;
+			if (ph < -M_PI)
+				ph += M_PI * 2.0;
+			
+			double dph = ph - ofdm->eq_phase[c];
+			if (dph > M_PI)
+				dph -= M_PI * 2.0;
+			if (dph < -M_PI)
+				dph += M_PI * 2.0;
+			ph = ofdm->eq_phase[c] + dph * iir;
 			if (ph > M_PI)
 				ph -= M_PI * 2.0;
 			if (ph < -M_PI)
@@ -62,31 +79,64 @@ void ofdm_eq(ofdm_state_t *ofdm)
 			ofdm->eq_phase[c] = ph;
 		}
 	}
-}
 	
-void ofdm_eq_debug(ofdm_state_t *ofdm)
+	ofdm->eq_valid = 1;
+}
+
+/* Compare the continual pilots against what the current estimate predicts
+ * for them.  If all that has changed is a common rotation, apply just that
+ * rotation and return 1; otherwise, return 0 to ask for a full
+ * reinterpolation.  */
+static int ofdm_eq_track(ofdm_state_t *ofdm)
 {
-	SDL_Rect r;
-	double re, im;
-	double complex p1, p2;
+	double complex acc = 0;
+	double epred = 0.0, erx = 0.0;
+	int i;
 	
-	if (!ofdm->eq_surf)
-	{
-		ofdm->eq_surf = SDL_CreateRGBSurface(SDL_SWSURFACE, DEBUG_XRES, DEBUG_YRES, 24, 0, 0, 0, 0);
-		r.x = r.y = 0;
-		r.w = DEBUG_XRES;
-		r.h = DEBUG_YRES;
-		SDL_FillRect(ofdm->eq_surf, &r, 0);
+	for (i = 0; ofdm->fft->continual_pilots[i] != -1; i++) {
+		int c = ofdm->fft->continual_pilots[i];
+		double complex rx, pred;
+		
+		rx = ofdm->fft_out[CARRIER(ofdm, c)][0] +
+		     ofdm->fft_out[CARRIER(ofdm, c)][1]*1i;
+		pred = ofdm->eq_ampl[c] * cexp(ofdm->eq_phase[c]*1i) *
+		       (dvbt_prbs[c] ? -4.0 / 3.0 : 4.0 / 3.0);
+		
+		acc += rx * conj(pred);
+		epred += creal(pred) * creal(pred) + cimag(pred) * cimag(pred);
+		erx += creal(rx) * creal(rx) + cimag(rx) * cimag(rx);
 	}
 	
-	int i;
-	float h = (float)ofdm->fft_symcount / 150.0;
-	h -= floor(h);
-	for (i = 0; i < MAX_CARRIERS; i++) {
-		r.x = i * DEBUG_XRES / MAX_CARRIERS;
-		r.y = DEBUG_YRES/2 + ofdm->eq_phase[i] / M_PI * (DEBUG_YRES/2);
-		r.w = r.h = 1;
+	if (epred == 0.0)
+		return 0;
+	
+	/* sum |rx - pred * e^(i phi)|^2, with phi chosen to minimize it */
+	ofdm->eq_residual = (erx + epred - 2.0 * cabs(acc)) / epred;
+	if (ofdm->eq_residual > ofdm->eq_threshold)
+		return 0;
 	
-		SDL_FillRect(ofdm->eq_surf, &r, hsvtorgb(h, 1.0, 1.0));
+	double phi = carg(acc);
+	for (int c = 0; c <= ofdm->fft->k_max; c++) {
+		double ph = ofdm->eq_phase[c] + phi;
+		if (ph > M_PI)
+			ph -= M_PI * 2.0;
+		if (ph < -M_PI)
+			ph += M_PI * 2.0;
+		ofdm->eq_phase[c] = ph;
 	}
+	
+	return 1;
+}
+
+void ofdm_eq(ofdm_state_t *ofdm)
+{
+	if (ofdm->eq_threshold == 0.0)
+		ofdm->eq_threshold = EQ_DEFAULT_THRESHOLD;
+	
+	ofdm->eq_symbols++;
+	if (ofdm->eq_adaptive && ofdm->eq_valid && ofdm_eq_track(ofdm))
+		return;
+	
+	ofdm->eq_full_updates++;
+	ofdm_eq_interpolate(ofdm);
 }
@@ -1,6 +1,9 @@
+#include <assert.h>
+#include <stdlib.h>
 #include "dvbt.h"
 
-char dvbt_prbs[8192];
+static char _dvbt_prbs[8192];
+const char *const dvbt_prbs = _dvbt_prbs;
 
 /* TPS carriers are always either:
  *   Re = 1, Im = 0
@@ -33,54 +36,245 @@ static int _continual_pilots_2048[] = {
 
 static uint16_t _scram_h_2048[1512];
 
-ofdm_params_t ofdm_params_2048 = {
+/* R[scram_perm[b]] = R'[b] */
+static int _scram_perm_2048[10] = {4, 3, 9, 6, 2, 8, 1, 5, 7, 0};
+
+static ofdm_params_t _params_2048 = {
         .size = 2048,
+        .mode = 0,
         .tps_carriers = _tps_carriers_2048,
         .continual_pilots = _continual_pilots_2048,
         .k_min_ofs = -851,
         .k_max = 1704,
         .n_max = 1512,
-        .scram_h = _scram_h_2048
+        .scram_h = _scram_h_2048,
+        .scram_bits = 10,
+        .scram_perm = _scram_perm_2048,
+        .scram_taps = (1 << 0) | (1 << 3)
 };
 
-/* Initialization bits */
-void ofdm_init_constants()
-{
-	int i;
+/* The 8k tables are the 2k tables, repeated every 1704 carriers. */
+static int _tps_carriers_8192[] = {
+	  34,   50,  209,  346,  413,
+	 569,  595,  688,  790,  901,
+	1073, 1219, 1262, 1286, 1469,
+	1594, 1687, 1738, 1754, 1913,
+	2050, 2117, 2273, 2299, 2392,
+	2494, 2605, 2777, 2923, 2966,
+	2990, 3173, 3298, 3391, 3442,
+	3458, 3617, 3754, 3821, 3977,
+	4003, 4096, 4198, 4309, 4481,
+	4627, 4670, 4694, 4877, 5002,
+	5095, 5146, 5162, 5321, 5458,
+	5525, 5681, 5707, 5800, 5902,
+	6013, 6185, 6331, 6374, 6398,
+	6581, 6706, 6799,
+	-1,
+};
 
-	/* Generate the 11-bit PRBS. */
-	int generator = 0x7FF;
-	for (i = 0; i < sizeof(dvbt_prbs) / sizeof(dvbt_prbs[0]); i++)
-	{
-		dvbt_prbs[i] = generator & 1;
-		generator =
-			(generator >> 1) |
-			(((generator & 1) ? 0x400 : 0) ^
-			 ((generator & 4) ? 0x400 : 0));
+static int _continual_pilots_8192[] = {
+	   0,   48,   54,   87,  141,  156,  192,
+	 201,  255,  279,  282,  333,  432,  450,
+	 483,  525,  531,  618,  636,  714,  759,
+	 765,  780,  804,  873,  888,  918,  939,
+	 942,  969,  984, 1050, 1101, 1107, 1110,
+	1137, 1140, 1146, 1206, 1269, 1323, 1377,
+	1491, 1683, 1704, 1752, 1758, 1791, 1845,
+	1860, 1896, 1905, 1959, 1983, 1986, 2037,
+	2136, 2154, 2187, 2229, 2235, 2322, 2340,
+	2418, 2463, 2469, 2484, 2508, 2577, 2592,
+	2622, 2643, 2646, 2673, 2688, 2754, 2805,
+	2811, 2814, 2841, 2844, 2850, 2910, 2973,
+	3027, 3081, 3195, 3387, 3408, 3456, 3462,
+	3495, 3549, 3564, 3600, 3609, 3663, 3687,
+	3690, 3741, 3840, 3858, 3891, 3933, 3939,
+	4026, 4044, 4122, 4167, 4173, 4188, 4212,
+	4281, 4296, 4326, 4347, 4350, 4377, 4392,
+	4458, 4509, 4515, 4518, 4545, 4548, 4554,
+	4614, 4677, 4731, 4785, 4899, 5091, 5112,
+	5160, 5166, 5199, 5253, 5268, 5304, 5313,
+	5367, 5391, 5394, 5445, 5544, 5562, 5595,
+	5637, 5643, 5730, 5748, 5826, 5871, 5877,
+	5892, 5916, 5985, 6000, 6030, 6051, 6054,
+	6081, 6096, 6162, 6213, 6219, 6222, 6249,
+	6252, 6258, 6318, 6381, 6435, 6489, 6603,
+	6795, 6816,
+	-1,
+};
+
+static uint16_t _scram_h_8192[6048];
+
+static int _scram_perm_8192[12] = {7, 1, 4, 2, 9, 6, 8, 10, 0, 3, 11, 5};
+
+static ofdm_params_t _params_8192 = {
+        .size = 8192,
+        .mode = 1,
+        .tps_carriers = _tps_carriers_8192,
+        .continual_pilots = _continual_pilots_8192,
+        .k_min_ofs = -3404, /* same frequency offset as the 2k set */
+        .k_max = 6816,
+        .n_max = 6048,
+        .scram_h = _scram_h_8192,
+        .scram_bits = 12,
+        .scram_perm = _scram_perm_8192,
+        .scram_taps = (1 << 0) | (1 << 1) | (1 << 4) | (1 << 6)
+};
+
+/* Switch a receiver over to a new parameter set, reallocating everything
+ * that is sized by it.  Everything downstream of the FFT has to
+ * resynchronize afterwards.  */
+void ofdm_set_mode(ofdm_state_t *ofdm, const ofdm_params_t *fft)
+{
+	if (ofdm->fft && ofdm->guard_len)
+		ofdm->guard_len = ofdm->guard_len * fft->size / ofdm->fft->size;
+	ofdm->fft = fft;
+	ofdm->fft_next = NULL;
+	
+	if (ofdm->fft_plan) {
+		pthread_mutex_lock(&ofdm_fftw_lock);
+		fftw_destroy_plan(ofdm->fft_plan);
+		pthread_mutex_unlock(&ofdm_fftw_lock);
 	}
+	if (ofdm->fft_in)
+		fftw_free(ofdm->fft_in);
+	if (ofdm->fft_out)
+		fftw_free(ofdm->fft_out);
+	if (ofdm->estim_buf)
+		fftw_free(ofdm->estim_buf);
+	ofdm->fft_plan = NULL;
+	ofdm->fft_in = ofdm->fft_out = ofdm->estim_buf = NULL;
+	ofdm->estim_refill = 0;
+	ofdm->estim_confidence = 0.0;
+	
+	free(ofdm->eq_phase);
+	free(ofdm->eq_ampl);
+	ofdm->eq_phase = calloc(fft->k_max + 1, sizeof(double));
+	ofdm->eq_ampl = calloc(fft->k_max + 1, sizeof(double));
+	assert(ofdm->eq_phase && ofdm->eq_ampl);
+	ofdm->eq_valid = 0;
 	
-	/* Generate H(q) for the symbol interleaver. */
+	ofdm->tps_bit = 0;
+	ofdm->tps_hunt = 0;
+	ofdm->tps_synchronized = 0;
+	ofdm->constel_ready = 0;
+}
+
+const ofdm_params_t *ofdm_params_for_mode(int mode)
+{
+	ofdm_init_constants();
+	switch (mode) {
+	case 0: return &_params_2048;
+	case 1: return &_params_8192;
+	default: return NULL;
+	}
+}
+
+/* Sort every carrier in a symbol into data, continual pilot, scattered
+ * pilot, or TPS, so that the demapper doesn't have to.  */
+static void ofdm_init_carrier_tables(ofdm_params_t *p)
+{
+	for (int sym = 0; sym < 4; sym++) {
+		int n = 0, sp = 0, pilot_c = 0, tps_c = 0;
+		
+		p->data_carriers[sym] = malloc(sizeof(int) * p->n_max);
+		p->data_bins[sym] = malloc(sizeof(int) * p->n_max);
+		p->scattered_pilots[sym] = malloc(sizeof(int) * (p->k_max / 12 + 2));
+		assert(p->data_carriers[sym] && p->data_bins[sym] && p->scattered_pilots[sym]);
+		
+		for (int c = 0; c <= p->k_max; c++) {
+			int is_pilot = 0;
+			
+			if (c == p->continual_pilots[pilot_c]) {
+				pilot_c++;
+				is_pilot = 1;
+			}
+			
+			if (c == p->tps_carriers[tps_c]) {
+				tps_c++;
+				continue;
+			}
+			
+			if ((c + 12 - 3 * sym) % 12 == 0) {
+				p->scattered_pilots[sym][sp++] = c;
+				continue;
+			}
+			
+			if (is_pilot)
+				continue;
+			
+			assert(n < p->n_max);
+			int bin = c + p->k_min_ofs;
+			if (bin < 0)
+				bin += p->size;
+			p->data_carriers[sym][n] = c;
+			p->data_bins[sym][n] = bin;
+			n++;
+		}
+		
+		p->scattered_pilots[sym][sp] = -1;
+		assert(n == p->n_max);
+	}
+}
+
+static void ofdm_init_params(ofdm_params_t *p)
+{
+	/* Generate H(q) for the symbol interleaver, section 4.3.4.2. */
 	uint16_t Rp;
-	/* R[bitscram[b]] = R'[b] */
-	int bitscram[10] = {4, 3, 9, 6, 2, 8, 1, 5, 7, 0};
 	int q = 0;
-	for (i = 0; i < 2048; i++) {
+	for (int i = 0; i < (2 << p->scram_bits); i++) {
 		if (i == 0 || i == 1) {
 			Rp = 0;
 		} else if (i == 2) {
 			Rp = 1;
 		} else {
-			Rp = (Rp >> 1) | (((Rp & 1) ^ ((Rp >> 3) & 1)) << 9);
+			Rp = (Rp >> 1) | (__builtin_parity(Rp & p->scram_taps) << (p->scram_bits - 1));
 		}
 		
 		uint16_t R = 0;
-		for (int b = 0; b < 10; b++)
-			R |= ((Rp >> b) & 1) << bitscram[b];
+		for (int b = 0; b < p->scram_bits; b++)
+			R |= ((Rp >> b) & 1) << p->scram_perm[b];
 		
-		uint16_t Hq = ((i & 1) << 10) | R;
-		if (Hq < ofdm_params_2048.n_max) {
-			_scram_h_2048[q] = Hq;
+		uint16_t Hq = ((i & 1) << p->scram_bits) | R;
+		if (Hq < p->n_max) {
+			p->scram_h[q] = Hq;
 			q++;
 		}
 	}
+	assert(q == p->n_max);
+	
+	ofdm_init_carrier_tables(p);
 }
+
+/* Initialization bits */
+static void ofdm_init_tables()
+{
+	int i;
+
+	/* Generate the 11-bit PRBS. */
+	int generator = 0x7FF;
+	for (i = 0; i < sizeof(_dvbt_prbs) / sizeof(_dvbt_prbs[0]); i++)
+	{
+		_dvbt_prbs[i] = generator & 1;
+		generator =
+			(generator >> 1) |
+			(((generator & 1) ? 0x400 : 0) ^
+			 ((generator & 4) ? 0x400 : 0));
+	}
+	
+	ofdm_init_params(&_params_2048);
+	ofdm_init_params(&_params_8192);
+	ofdm_init_demap();
+	ofdm_init_tps();
+	ofdm_init_deinterleave(&_params_2048);
+	ofdm_init_deinterleave(&_params_8192);
+}
+
+/* Build the shared tables, if nobody has yet; safe to call from any
+ * number of threads at once.  */
+void ofdm_init_constants()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, ofdm_init_tables);
+}
+
@@ -0,0 +1,77 @@
+/* One receiver, from samples to bits. */
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "dvbt.h"
+
+/* FFTW's planner isn't thread-safe, though executing a plan is.  */
+pthread_mutex_t ofdm_fftw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ofdm_init(ofdm_state_t *ofdm, const ofdm_params_t *fft, ofdm_input_t input, void *input_priv,
+               ofdm_output_t output, void *output_priv)
+{
+	ofdm_init_constants();
+
+	memset(ofdm, 0, sizeof(*ofdm));
+	ofdm->input = input;
+	ofdm->input_priv = input_priv;
+	ofdm->output = output;
+	ofdm->output_priv = output_priv;
+
+	ofdm_set_mode(ofdm, fft);
+	ofdm->guard_len = ofdm->fft->size / 32;
+	ofdm->mode_auto = 1;
+	ofdm->snr = 100.0; /* 20dB */
+	ofdm->cpe_enabled = 1;
+}
+
+/* Take in a symbol, and pass on its bits, if we're far enough along to
+ * have any.  */
+void ofdm_symbol(ofdm_state_t *ofdm)
+{
+	if (ofdm->fft_next)
+		ofdm_set_mode(ofdm, ofdm->fft_next);
+
+	if (!ofdm->fft_in)
+		ofdm->fft_in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * ofdm->fft->size);
+	assert(ofdm->fft_in);
+	if (!ofdm->fft_out)
+		ofdm->fft_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * ofdm->fft->size);
+	assert(ofdm->fft_out);
+	if (!ofdm->fft_plan) {
+		pthread_mutex_lock(&ofdm_fftw_lock);
+		ofdm->fft_plan = fftw_plan_dft_1d(ofdm->fft->size, ofdm->fft_in, ofdm->fft_out, FFTW_FORWARD, FFTW_MEASURE);
+		pthread_mutex_unlock(&ofdm_fftw_lock);
+	}
+	assert(ofdm->fft_plan);
+
+	ofdm_estimate_symbol(ofdm);
+
+	fftw_execute(ofdm->fft_plan);
+
+	ofdm_cpe(ofdm);
+
+	ofdm_tps(ofdm);
+
+	ofdm_eq(ofdm);
+
+	ofdm_constel(ofdm);
+}
+
+void ofdm_free(ofdm_state_t *ofdm)
+{
+	if (ofdm->fft_plan) {
+		pthread_mutex_lock(&ofdm_fftw_lock);
+		fftw_destroy_plan(ofdm->fft_plan);
+		pthread_mutex_unlock(&ofdm_fftw_lock);
+	}
+	if (ofdm->fft_in)
+		fftw_free(ofdm->fft_in);
+	if (ofdm->fft_out)
+		fftw_free(ofdm->fft_out);
+	if (ofdm->estim_buf)
+		fftw_free(ofdm->estim_buf);
+	free(ofdm->eq_phase);
+	free(ofdm->eq_ampl);
+	memset(ofdm, 0, sizeof(*ofdm));
+}
@@ -1,52 +1,150 @@
+#include <string.h>
+#include <stdio.h>
 #include "dvbt.h"
 
+/* TPS is protected by BCH(67,53), shortened from BCH(127,113), section
+ * 4.6.2.5: s1 through s53 are the data, and s54 through s67 are parity.
+ * With t = 2, every error pattern of weight 2 or less has a distinct
+ * syndrome, so we just keep a table from syndrome to error positions.  */
+#define TPS_BCH_POLY 0x4377 /* x^14 + x^9 + x^8 + x^6 + x^5 + x^4 + x^2 + x + 1 */
+#define TPS_BCH_BITS 14
+
+static uint16_t _tps_bch_fix[1 << TPS_BCH_BITS]; /* (p1 | p2 << 7), 0 if none */
+
+/* Remainder of s1..s67 (s1 being the highest order term) by g(x). */
+static uint16_t ofdm_tps_syndrome(const uint8_t *s)
+{
+	uint32_t rem = 0;
+	
+	for (int i = 1; i < TPS_N_BITS; i++) {
+		rem = (rem << 1) | s[i];
+		if (rem & (1 << TPS_BCH_BITS))
+			rem ^= TPS_BCH_POLY;
+	}
+	return rem;
+}
+
+void ofdm_init_tps()
+{
+	uint16_t syn[TPS_N_BITS];
+	uint8_t s[TPS_N_BITS];
+	
+	for (int p = 1; p < TPS_N_BITS; p++) {
+		memset(s, 0, sizeof(s));
+		s[p] = 1;
+		syn[p] = ofdm_tps_syndrome(s);
+	}
+	
+	for (int p = 1; p < TPS_N_BITS; p++) {
+		_tps_bch_fix[syn[p]] = p;
+		for (int q = p + 1; q < TPS_N_BITS; q++)
+			_tps_bch_fix[syn[p] ^ syn[q]] = p | (q << 7);
+	}
+}
+
+/* Try to decode s[0..67] as a TPS frame, correcting it in place; returns
+ * the number of bits corrected, or -1 if it isn't one.  */
+static int ofdm_tps_decode(uint8_t *s)
+{
+	int fixed = 0;
+	uint16_t syn = ofdm_tps_syndrome(s);
+	
+	if (syn) {
+		uint16_t fix = _tps_bch_fix[syn];
+		if (!fix)
+			return -1;
+		s[fix & 0x7F] ^= 1;
+		fixed++;
+		if (fix >> 7) {
+			s[fix >> 7] ^= 1;
+			fixed++;
+		}
+	}
+	
+	/* Sync word, in either polarity. */
+	uint16_t sync = 0;
+	for (int i = 1; i <= 16; i++)
+		sync = (sync << 1) | s[i];
+	if (sync != TPS_SYNC && sync != ((~TPS_SYNC) & 0xFFFF))
+		return -1;
+	
+	return fixed;
+}
+
 /* TPS acquisition takes place on non-equalized carriers, since DBPSK! */
 void ofdm_tps(ofdm_state_t *ofdm)
 {
 	int c;
 	double complex cur[MAX_TPS_CARRIERS];
-	double dot[MAX_TPS_CARRIERS];
-	int votes[2] = {0,0};
-	int tvotes;
+	double soft = 0.0, mag = 0.0;
 	int bit;
+	int valid = 0;
 	
+	/* Combine all of the carriers' differential phases, weighted by
+	 * their amplitude, before deciding.  */
 	for (c = 0; ofdm->fft->tps_carriers[c] != -1; c++) {
 		cur[c] = ofdm->fft_out[CARRIER(ofdm, ofdm->fft->tps_carriers[c])][0] +
-		         ofdm->fft_out[CARRIER(ofdm, ofdm->fft->tps_carriers[c])][0]*1i;
-		dot[c] = creal(cur[c]) * creal(ofdm->tps_last[c]) +
-		         cimag(cur[c]) * cimag(ofdm->tps_last[c]);
-		votes[dot[c] < 0]++;
+		         ofdm->fft_out[CARRIER(ofdm, ofdm->fft->tps_carriers[c])][1]*1i;
+		soft += creal(cur[c]) * creal(ofdm->tps_last[c]) +
+		        cimag(cur[c]) * cimag(ofdm->tps_last[c]);
+		mag += cabs(cur[c]) * cabs(ofdm->tps_last[c]);
 	}
 	
 	for (c = 0; ofdm->fft->tps_carriers[c] != -1; c++)
 		ofdm->tps_last[c] = cur[c];
 
-	bit = votes[1] > votes[0];
-	tvotes = votes[0] + votes[1];
-	if (votes[0] > (tvotes / 3) &&
-	    votes[1] > (tvotes / 3))
-		printf("TPS receiver is feeling a little nervous about %d/%d votes on bit %d\n", votes[0], votes[1], ofdm->tps_bit);
+	bit = soft < 0;
+	if (fabs(soft) < mag / 3.0)
+		OFDM_LOG(ofdm, "TPS receiver is feeling a little nervous about %.0f/%.0f on bit %d\n", soft, mag, ofdm->tps_bit);
 	
-	ofdm->tps_rx[ofdm->tps_bit / 8] &= ~(1 << (7 - (ofdm->tps_bit % 8)));
-	ofdm->tps_rx[ofdm->tps_bit / 8] |= bit << (7 - (ofdm->tps_bit % 8));
+	/* Keep the last whole frame's worth of bits around, newest last. */
+	memmove(ofdm->tps_hist, ofdm->tps_hist + 1, TPS_N_BITS - 1);
+	ofdm->tps_hist[TPS_N_BITS - 1] = bit;
 	ofdm->tps_bit++;
+	if (ofdm->tps_bit > TPS_N_BITS)
+		ofdm->tps_bit = 1;
 	
-	ofdm->tps_lastrx <<= 1;
-	ofdm->tps_lastrx |= bit;
-	if ((ofdm->tps_lastrx == TPS_SYNC) ||
-	    (ofdm->tps_lastrx == ((~TPS_SYNC) & 0xFFFF))) {
-		if (ofdm->tps_bit != TPS_SYNCBIT) {
-			printf("TPS receiver has resynchronized, was at bit %d\n", ofdm->tps_bit);
+	/* Until we're locked, any symbol could be the end of a frame. */
+	if (!ofdm->tps_synchronized || ofdm->tps_bit == TPS_N_BITS) {
+		uint8_t s[TPS_N_BITS];
+		memcpy(s, ofdm->tps_hist, TPS_N_BITS);
+		
+		int fixed = ofdm_tps_decode(s);
+		if (fixed >= 0) {
+			if (ofdm->tps_bit != TPS_N_BITS)
+				OFDM_LOG(ofdm, "TPS receiver has synchronized, was at bit %d\n", ofdm->tps_bit);
+			if (fixed)
+				OFDM_LOG(ofdm, "TPS receiver corrected %d bit%s\n", fixed, fixed == 1 ? "" : "s");
+			ofdm->tps_bit = TPS_N_BITS;
+			ofdm->tps_bad = 0;
+			valid = 1;
+			memset(ofdm->tps_rx, 0, sizeof(ofdm->tps_rx));
+			for (int i = 0; i < TPS_N_BITS; i++)
+				ofdm->tps_rx[i / 8] |= s[i] << (7 - (i % 8));
+		} else if (ofdm->tps_synchronized && ++ofdm->tps_bad > TPS_MAX_BAD) {
+			OFDM_LOG(ofdm, "TPS receiver has lost synchronization\n");
+			ofdm->tps_synchronized = 0;
+			ofdm->constel_ready = 0;
 		}
-		ofdm->tps_bit = TPS_SYNCBIT;
 	}
 	
 	ofdm->symbol = ofdm->tps_bit - 1;
 	
+	/* We can't hear TPS at all in the wrong mode, so if it's been too
+	 * long, try the other one.  Any frame that decodes means we're in the
+	 * right one, even if it's a signal we can't receive.  */
+	if (ofdm->tps_synchronized || valid)
+		ofdm->tps_hunt = 0;
+	else if (++ofdm->tps_hunt > TPS_HUNT_SYMBOLS && ofdm->mode_auto) {
+		OFDM_LOG(ofdm, "TPS receiver has not synchronized; trying %s mode\n", ofdm->fft->mode ? "2k" : "8k");
+		ofdm->fft_next = ofdm_params_for_mode(!ofdm->fft->mode);
+		ofdm->tps_hunt = 0;
+	}
+	
 	if (ofdm->symbol == 0)
 		ofdm->frame = (ofdm->frame + 1) % 4;
 	
-	if (ofdm->tps_bit == TPS_N_BITS) {
+	if (valid) {
 		int frame = ((ofdm->tps_rx[2] & 1) << 1) | (ofdm->tps_rx[3] >> 7);
 		int constellation = (ofdm->tps_rx[3] >> 5) & 3;
 		int hierarchy = (ofdm->tps_rx[3] >> 2) & 7;
@@ -65,7 +163,7 @@ void ofdm_tps(ofdm_state_t *ofdm)
 	(x == 4) ? "code rate 7/8" : \
 	           "illegal code rate"
 
-		printf("TPS receiver has received TPS frame: frame %d, %s, %s, %s%s%s%s, guard interval %s, %s\n",
+		OFDM_LOG(ofdm, "TPS receiver has received TPS frame: frame %d, %s, %s, %s%s%s%s, guard interval %s, %s\n",
 			frame,
 			constellation == 0 ? "QPSK" :
 			constellation == 1 ? "QAM16" :
@@ -89,18 +187,21 @@ void ofdm_tps(ofdm_state_t *ofdm)
 			mode == 2 ? "DVB-M FFT" :
 			            "invalid FFT"
 			);
-                printf("{");
-                for (int i = 0; i <= 67/8; i++)
-                        printf("0x%x, ", ofdm->tps_rx[i]);
-                printf("0x00}\n");
-                
                 ofdm->tps_synchronized = 1;
                 ofdm->tps_constellation = constellation;
                 ofdm->tps_hierarchy = hierarchy;
-                if (constellation != 1 || hierarchy != 0 || guard != 0 || codehp != 1 || mode != 0) {
-		        printf("*** TPS signal reports unsupported hierarchy ***\n");
+                ofdm->tps_code_hp = codehp;
+                ofdm->tps_code_lp = codelp;
+                if (!dvbt_demap(constellation, hierarchy) || guard != 0 || codehp > 4 || (hierarchy && codelp > 4) || !ofdm_params_for_mode(mode)) {
+		        OFDM_LOG(ofdm, "*** TPS signal reports unsupported hierarchy ***\n");
+		        ofdm->tps_synchronized = 0;
+                } else if (ofdm_params_for_mode(mode) != ofdm->fft) {
+		        OFDM_LOG(ofdm, "*** TPS signal reports a different FFT mode; switching ***\n");
 		        ofdm->tps_synchronized = 0;
+		        ofdm->fft_next = ofdm_params_for_mode(mode);
                 }
-		ofdm->tps_bit = 0;
 	}
+	
+	if (ofdm->tps_bit == TPS_N_BITS)
+		ofdm->tps_bit = 0;
 }
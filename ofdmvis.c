@@ -8,17 +8,33 @@
 
 #include "dvbt.h"
 
-/* XXX: struct */
-fftw_complex *symbols;
-int nsymbols;
+#define DEBUG_XRES 240
+#define DEBUG_YRES 240
 
-int ofdm_load(struct ofdm_state *ofdm, char *filename)
+/* Everything the visualizer needs, on top of the receiver itself. */
+typedef struct ofdmvis {
+	ofdm_state_t ofdm;
+	
+	/* Sample source: the whole file, played round and round */
+	double *samples;
+	int nsamples;
+	int cursamp;
+	
+	SDL_Window *window;
+	SDL_Surface *master;
+	SDL_Surface *fft_surf;
+	SDL_Surface *eq_surf;
+	int symcount;
+	int dbg_carrier;
+	Uint32 last_render;
+} ofdmvis_t;
+
+int ofdm_load(ofdmvis_t *vis, char *filename)
 {
-	int allocsize;
-	int fd, rv;
+	int fd;
 	
-	ofdm->samples = NULL;
-	ofdm->nsamples = 0;
+	vis->samples = NULL;
+	vis->nsamples = 0;
 	
 	fd = open(filename, O_RDONLY);
 	if (fd < 0)
@@ -27,27 +43,34 @@ int ofdm_load(struct ofdm_state *ofdm, char *filename)
 	off_t len = lseek(fd, 0, SEEK_END);
 	lseek(fd, 0, SEEK_SET);
 
-	ofdm->samples = realloc(ofdm->samples, len);
-	read(fd, ofdm->samples, len);
+	vis->samples = realloc(vis->samples, len);
+	read(fd, vis->samples, len);
 
-	ofdm->nsamples = len / sizeof(double) / 2;
+	vis->nsamples = len / sizeof(double) / 2;
 	
 	close(fd);
 	
 	return 0;
 }
 
-void ofdm_getsamples(ofdm_state_t *ofdm, int nreq, fftw_complex *out)
+void ofdm_getsamples(void *priv, int nreq, fftw_complex *out)
 {
+	ofdmvis_t *vis = priv;
+	
 	while (nreq--)
 	{
-		(*out)[0] = ofdm->samples[ofdm->cursamp*2];
-		(*out)[1] = ofdm->samples[ofdm->cursamp*2+1];
+		(*out)[0] = vis->samples[vis->cursamp*2];
+		(*out)[1] = vis->samples[vis->cursamp*2+1];
 		out++;
-		ofdm->cursamp = (ofdm->cursamp + 1) % ofdm->nsamples;
+		vis->cursamp = (vis->cursamp + 1) % vis->nsamples;
 	}
 }
 
+void ofdm_putbits(void *priv, const uint8_t *buf, int len)
+{
+	write(2, buf, len);
+}
+
 uint32_t hsvtorgb(float H, float S, float V)
 {
 	float r = 0, g = 0, b = 0;
@@ -77,21 +100,25 @@ uint32_t hsvtorgb(float H, float S, float V)
 	return ri + (gi << 8) + (bi << 16);
 }
 
-void ofdm_fft_debug(ofdm_state_t *ofdm, fftw_complex *carriers)
+void ofdm_fft_debug(ofdmvis_t *vis, fftw_complex *carriers)
 {
+	ofdm_state_t *ofdm = &vis->ofdm;
 	SDL_Rect r;
 	double re, im;
 	
-	if (!ofdm->fft_surf)
+	if (!vis->fft_surf)
 	{
-		ofdm->fft_surf = SDL_CreateRGBSurface(SDL_SWSURFACE, DEBUG_XRES, DEBUG_YRES, 24, 0, 0, 0, 0);
+		vis->fft_surf = SDL_CreateRGBSurface(SDL_SWSURFACE, DEBUG_XRES, DEBUG_YRES, 24, 0, 0, 0, 0);
 		r.x = r.y = 0;
 		r.w = DEBUG_XRES;
 		r.h = DEBUG_YRES;
-		SDL_FillRect(ofdm->fft_surf, &r, 0);
+		SDL_FillRect(vis->fft_surf, &r, 0);
 	}
 	
-	ofdm->fft_symcount++;
+	vis->symcount++;
+	
+	if (vis->dbg_carrier < 0 || vis->dbg_carrier > ofdm->fft->k_max)
+		return;
 	
 #ifdef MATCH_PHASE_TO_CHAR_0
 	double complex p1, p2;
@@ -99,18 +126,18 @@ void ofdm_fft_debug(ofdm_state_t *ofdm, fftw_complex *carriers)
 	/* HACK HACK: match phase to carrier 0 */
 	p1 = carriers[CARRIER(ofdm, 0)][0] +
 	     carriers[CARRIER(ofdm, 0)][1]*1i;
-	p2 = carriers[CARRIER(ofdm, ofdm->fft_dbg_carrier)][0] +
-	     carriers[CARRIER(ofdm, ofdm->fft_dbg_carrier)][1]*1i;
+	p2 = carriers[CARRIER(ofdm, vis->dbg_carrier)][0] +
+	     carriers[CARRIER(ofdm, vis->dbg_carrier)][1]*1i;
 	p2 *= cexp(-carg(p1)*1i);
 
 	re = creal(p2);
 	im = cimag(p2);
 #else
 	double complex p;
-	p = carriers[CARRIER(ofdm, ofdm->fft_dbg_carrier)][0] +
-	    carriers[CARRIER(ofdm, ofdm->fft_dbg_carrier)][1]*1i;
-	p *= cexp(-ofdm->eq_phase[ofdm->fft_dbg_carrier]*1i);
-	p /= ofdm->eq_ampl[ofdm->fft_dbg_carrier];
+	p = carriers[CARRIER(ofdm, vis->dbg_carrier)][0] +
+	    carriers[CARRIER(ofdm, vis->dbg_carrier)][1]*1i;
+	p *= cexp(-ofdm->eq_phase[vis->dbg_carrier]*1i);
+	p /= ofdm->eq_ampl[vis->dbg_carrier];
 	
 	re = creal(p);
 	im = cimag(p);
@@ -125,39 +152,49 @@ void ofdm_fft_debug(ofdm_state_t *ofdm, fftw_complex *carriers)
 	if (im < -1.0) im = -1.0;
 	if (im > 1.0)  im = 1.0;
 	
-	float h = (float)ofdm->fft_symcount / 150.0;
+	float h = (float)vis->symcount / 150.0;
 	h -= floor(h);
 	r.x = DEBUG_XRES/2 + re * DEBUG_XRES/2;
 	r.y = DEBUG_YRES/2 + im * DEBUG_YRES/2;
 	r.w = r.h = 2;
 	
-	SDL_FillRect(ofdm->fft_surf, &r, hsvtorgb(h, 1.0, 1.0));
+	SDL_FillRect(vis->fft_surf, &r, hsvtorgb(h, 1.0, 1.0));
 }
 
-void ofdm_fft_symbol(ofdm_state_t *ofdm)
+void ofdm_eq_debug(ofdmvis_t *vis)
 {
-	if (!ofdm->fft_in)
-		ofdm->fft_in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * ofdm->fft->size);
-	assert(ofdm->fft_in);
-	if (!ofdm->fft_out)
-		ofdm->fft_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * ofdm->fft->size);
-	assert(ofdm->fft_out);
-	if (!ofdm->fft_plan)
-		ofdm->fft_plan = fftw_plan_dft_1d(ofdm->fft->size, ofdm->fft_in, ofdm->fft_out, FFTW_FORWARD, FFTW_MEASURE);
-	assert(ofdm->fft_plan);
-	
-	ofdm_estimate_symbol(ofdm);
-	
-	fftw_execute(ofdm->fft_plan);
+	ofdm_state_t *ofdm = &vis->ofdm;
+	SDL_Rect r;
 	
-	ofdm_fft_debug(ofdm, ofdm->fft_out);
+	if (!vis->eq_surf)
+	{
+		vis->eq_surf = SDL_CreateRGBSurface(SDL_SWSURFACE, DEBUG_XRES, DEBUG_YRES, 24, 0, 0, 0, 0);
+		r.x = r.y = 0;
+		r.w = DEBUG_XRES;
+		r.h = DEBUG_YRES;
+		SDL_FillRect(vis->eq_surf, &r, 0);
+	}
 	
-	ofdm_tps(ofdm);
+	int i;
+	float h = (float)vis->symcount / 150.0;
+	h -= floor(h);
+	for (i = 0; i <= ofdm->fft->k_max; i++) {
+		r.x = i * DEBUG_XRES / (ofdm->fft->k_max + 1);
+		r.y = DEBUG_YRES/2 + ofdm->eq_phase[i] / M_PI * (DEBUG_YRES/2);
+		r.w = r.h = 1;
 	
-	ofdm_eq(ofdm);
-	ofdm_eq_debug(ofdm);
+		SDL_FillRect(vis->eq_surf, &r, hsvtorgb(h, 1.0, 1.0));
+	}
+}
+
+/* The receiver runs a symbol at a time; we just look at what it left
+ * behind.  */
+void ofdm_fft_symbol(ofdmvis_t *vis)
+{
+	ofdm_symbol(&vis->ofdm);
 	
-	ofdm_constel(ofdm);
+	ofdm_fft_debug(vis, vis->ofdm.fft_out);
+	ofdm_eq_debug(vis);
 }
 
 /* Rendering bits */
@@ -165,62 +202,56 @@ void ofdm_fft_symbol(ofdm_state_t *ofdm)
 #define XRES DEBUG_XRES
 #define YRES (DEBUG_YRES*2)
 
-void ofdm_render(ofdm_state_t *ofdm, SDL_Surface *master, int x, int y)
+void ofdm_render(ofdmvis_t *vis, int x, int y)
 {
 	SDL_Rect dst;
 	
-	if (ofdm->fft_surf)
+	if (vis->fft_surf)
 	{
 		dst.x = x;
 		dst.y = y;
 		dst.w = DEBUG_XRES;
 		dst.h = DEBUG_YRES;
-		SDL_BlitSurface(ofdm->fft_surf, NULL, master, &dst);
+		SDL_BlitSurface(vis->fft_surf, NULL, vis->master, &dst);
 		dst.x = x + DEBUG_XRES / 2;
 		dst.y = y;
 		dst.w = 1;
 		dst.h = DEBUG_YRES;
-		SDL_FillRect(master, &dst, 0xFFFFFFFF);
+		SDL_FillRect(vis->master, &dst, 0xFFFFFFFF);
 		dst.y = y + DEBUG_YRES / 2;
 		dst.x = x;
 		dst.h = 1;
 		dst.w = DEBUG_XRES;
-		SDL_FillRect(master, &dst, 0xFFFFFFFF);
+		SDL_FillRect(vis->master, &dst, 0xFFFFFFFF);
 	}
 	
-	if (ofdm->eq_surf)
+	if (vis->eq_surf)
 	{
 		dst.x = x;
 		dst.y = y+DEBUG_YRES;
 		dst.w = DEBUG_XRES;
 		dst.h = DEBUG_YRES;
-		SDL_BlitSurface(ofdm->eq_surf, NULL, master, &dst);
+		SDL_BlitSurface(vis->eq_surf, NULL, vis->master, &dst);
 	}
 }
 
-void ofdm_clear(ofdm_state_t *ofdm)
+void ofdm_clear(ofdmvis_t *vis)
 {
-	SDL_FillRect(ofdm->fft_surf, NULL, 0x0);
-	SDL_FillRect(ofdm->eq_surf, NULL, 0x0);
+	SDL_FillRect(vis->fft_surf, NULL, 0x0);
+	SDL_FillRect(vis->eq_surf, NULL, 0x0);
 }
 
 /* Main SDL goop */
 
-static ofdm_state_t ofdm = {0};
-static SDL_Window *window;
-static SDL_Surface *master;
-
-static void update()
+static void update(ofdmvis_t *vis)
 {
-	static int last = 0;
-	
-	ofdm_fft_symbol(&ofdm);
-	if (SDL_GetTicks() > (last + 100))
+	ofdm_fft_symbol(vis);
+	if (SDL_GetTicks() > (vis->last_render + 100))
 	{
-		ofdm_render(&ofdm, master, 0, 0);
-		SDL_UpdateWindowSurface(window);
+		ofdm_render(vis, 0, 0);
+		SDL_UpdateWindowSurface(vis->window);
 		
-		last = SDL_GetTicks();
+		vis->last_render = SDL_GetTicks();
 	}
 }
 
@@ -236,18 +267,35 @@ static Uint32 tick(Uint32 interval, void *p)
 
 int main(int argc, char** argv)
 {
+	static ofdmvis_t vis;
+	ofdm_state_t *ofdm = &vis.ofdm;
 	SDL_Event ev;
 	int new_carrier = -1;
+	int opt;
+	int start_8k = 0;
+	int soft = 0;
+	
+	while ((opt = getopt(argc, argv, "s8")) != -1) {
+		switch (opt) {
+		case 's':
+			soft = 1;
+			break;
+		case '8':
+			start_8k = 1;
+			break;
+		default:
+			printf("usage: %s [-s] [-8] [file]\n", argv[0]);
+			printf("  -s: write soft bits (one int8 LLR per bit) instead of hard bits\n");
+			printf("  -8: start looking for an 8k signal, rather than 2k\n");
+			exit(1);
+		}
+	}
 	
-	ofdm_init_constants();
-	
-	memset(&ofdm, 0, sizeof(ofdm));
-	
-	ofdm.fft = &ofdm_params_2048;
-	ofdm.guard_len = ofdm.fft->size / 32;
-
-	ofdm.fft_dbg_carrier = 1491;
-	ofdm.snr = 100.0; /* 20dB */
+	ofdm_init(ofdm, ofdm_params_for_mode(start_8k), ofdm_getsamples, &vis, ofdm_putbits, NULL);
+	ofdm->constel_soft = soft;
+	ofdm->constel_check_pilots = 1;
+	ofdm->log = stdout; /* the bits go to stderr */
+	vis.dbg_carrier = 1491;
 	
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0)
 	{
@@ -256,21 +304,21 @@ int main(int argc, char** argv)
 	}
 	atexit(SDL_Quit);
 	
-	window = SDL_CreateWindow("OFDM Visualizer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, XRES, YRES, 0);
-	if (!window)
+	vis.window = SDL_CreateWindow("OFDM Visualizer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, XRES, YRES, 0);
+	if (!vis.window)
 	{
 		printf("SDL video init failed: %s\n", SDL_GetError());
 		exit(1);
 	}
 	
-	master = SDL_GetWindowSurface(window);
-	if (!master)
+	vis.master = SDL_GetWindowSurface(vis.window);
+	if (!vis.master)
 	{
 		printf("SDL video init failed: %s\n", SDL_GetError());
 		exit(1);
 	}
 	
-	if (ofdm_load(&ofdm, (argc > 1) ? argv[1] : "dvbt.mixed.raw") < 0)
+	if (ofdm_load(&vis, (optind < argc) ? argv[optind] : "dvbt.mixed.raw") < 0)
 	{
 		printf("failed to load file\n");
 		exit(1);
@@ -288,18 +336,25 @@ int main(int argc, char** argv)
 			    	exit(0);
 			case SDLK_LEFT:
 			case SDLK_RIGHT:
-				ofdm.fft_dbg_carrier += (ev.key.keysym.sym == SDLK_LEFT) ? -1 : 1;
-				printf("Viewing carrier %d\n", ofdm.fft_dbg_carrier);
-				ofdm_clear(&ofdm);
+				vis.dbg_carrier += (ev.key.keysym.sym == SDLK_LEFT) ? -1 : 1;
+				printf("Viewing carrier %d\n", vis.dbg_carrier);
+				ofdm_clear(&vis);
 				break;
 			case SDLK_SPACE:
-				ofdm_clear(&ofdm);
+				ofdm_clear(&vis);
+				break;
+			case SDLK_a:
+				printf("EQ: %d of %d symbols needed a full update; adaptive EQ now %s\n",
+					ofdm->eq_full_updates, ofdm->eq_symbols,
+					ofdm->eq_adaptive ? "off" : "on");
+				ofdm->eq_adaptive = !ofdm->eq_adaptive;
+				ofdm->eq_full_updates = ofdm->eq_symbols = 0;
 				break;
 			case SDLK_RETURN:
 				if (new_carrier != -1) {
-					ofdm.fft_dbg_carrier = new_carrier;
-					printf("Viewing carrier %d\n", ofdm.fft_dbg_carrier);
-					ofdm_clear(&ofdm);
+					vis.dbg_carrier = new_carrier;
+					printf("Viewing carrier %d\n", vis.dbg_carrier);
+					ofdm_clear(&vis);
 					new_carrier = -1;
 				}
 				break;
@@ -321,7 +376,7 @@ int main(int argc, char** argv)
 			
 			break;
 		case SDL_USEREVENT:
-			update();
+			update(&vis);
 			break;
 		case SDL_QUIT:
 			exit(0);
@@ -330,4 +385,3 @@ int main(int argc, char** argv)
 	
 	exit(0);
 }
-
@@ -1,20 +1,32 @@
 #include <stdint.h>
-#include <stdlib.h>
+#include <unistd.h>
 #include <stdio.h>
+#include "outer_decoder.h"
 
-void main() {
-	uint8_t c;
-	int phase = 0;
-	uint8_t fifo[11][17*11] = {};
-	
-	while (read(0, &c, 1) == 1) {
-		if (phase == 11)
-			write(1, &c, 1);
-		else {
-			write(1, fifo[phase], 1);
-			memmove(fifo[phase], fifo[phase] + 1, (11 - phase) * 17);
-			fifo[phase][(11 - phase) * 17 - 1] = c;
-		}
-		phase = (phase + 1) % 12;
+/* Outer deinterleaver on its own: bytes from the inner decoder in on
+ * stdin, 204-byte packets (starting on a sync byte) out on stdout.  */
+
+void outer_write_stdout(void *priv, uint8_t *buf, int len) {
+	(void) priv;
+	while (len > 0) {
+		ssize_t n = write(1, buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
 	}
 }
+
+int main(void) {
+	static uint8_t inbuf[65536];
+	static outer_deint_t d;
+	ssize_t len;
+
+	outer_deint_init(&d, outer_write_stdout, NULL);
+	while ((len = read(0, inbuf, sizeof(inbuf))) > 0)
+		outer_deint_push(&d, inbuf, len);
+
+	fprintf(stderr, "%lld packets; locked %d times, lost sync %d times.\n",
+	        (long long)d.packets, d.syncs, d.losses);
+	return 0;
+}
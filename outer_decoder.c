@@ -0,0 +1,441 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "outer_decoder.h"
+
+#define RS_N OUTER_PKT
+#define RS_K OUTER_TS
+#define RS_PARITY (RS_N - RS_K)
+#define RS_T (RS_PARITY / 2)
+#define RS_POLY 0x11D /* p(x) = x^8 + x^4 + x^3 + x^2 + 1 */
+
+static uint8_t rs_exp[2 * 255];
+static uint8_t rs_log[256];
+
+/* t * (g(x) - x^16), with the coefficient of x^k in byte k; lo holds x^0
+ * to x^7 and hi x^8 to x^15, which is also how the remainder is kept.  */
+static uint64_t rs_glo[256], rs_ghi[256];
+
+/* Energy dispersal, section 4.3.1: every group of 8 packets is XORed with
+ * the same stretch of the 1 + x^14 + x^15 PRBS, restarted at the first
+ * packet of the group (whose sync byte is sent inverted, as 0xB8).  The
+ * PRBS keeps running, unused, through the other seven sync bytes.  So all
+ * of it is one fixed 8 x 188 byte mask.  */
+static uint8_t prbs_mask[OUTER_GROUP * OUTER_TS];
+
+static uint8_t rs_mul(uint8_t a, uint8_t b) {
+	if (!a || !b)
+		return 0;
+	return rs_exp[rs_log[a] + rs_log[b]];
+}
+
+static uint8_t rs_div(uint8_t a, uint8_t b) {
+	if (!a)
+		return 0;
+	return rs_exp[rs_log[a] + 255 - rs_log[b]];
+}
+
+static void outer_init_tables() {
+	uint8_t g[RS_PARITY + 1] = { 1 };
+	int x = 1;
+
+	for (int i = 0; i < 255; i++) {
+		rs_exp[i] = rs_exp[i + 255] = x;
+		rs_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= RS_POLY;
+	}
+
+	/* g(x) = (x + 1)(x + a)...(x + a^15), section 4.3.2. */
+	for (int i = 0; i < RS_PARITY; i++) {
+		for (int k = i + 1; k > 0; k--)
+			g[k] = g[k - 1] ^ rs_mul(g[k], rs_exp[i]);
+		g[0] = rs_mul(g[0], rs_exp[i]);
+	}
+
+	for (int t = 0; t < 256; t++) {
+		rs_glo[t] = rs_ghi[t] = 0;
+		for (int k = 0; k < 8; k++) {
+			rs_glo[t] |= (uint64_t)rs_mul(t, g[k]) << (8 * k);
+			rs_ghi[t] |= (uint64_t)rs_mul(t, g[k + 8]) << (8 * k);
+		}
+	}
+
+	uint32_t lfsr = 0x4A80; /* 100101010000000 */
+	for (int i = 0; i < OUTER_GROUP * OUTER_TS; i++) {
+		uint8_t out = 0;
+		for (int b = 7; b >= 0; b--) {
+			int fb = (lfsr & 1) ^ ((lfsr >> 1) & 1);
+			lfsr = (lfsr >> 1) | (fb << 14);
+			out |= fb << b;
+		}
+		/* Byte i + 1 of the group; the sync bytes aren't scrambled. */
+		if ((i + 1) % OUTER_TS)
+			prbs_mask[i + 1] = out;
+	}
+}
+
+static void outer_init_once() {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, outer_init_tables);
+}
+
+/* Deinterleaver, section 4.3.2.  Byte i of the stream goes through branch
+ * i % 12, which the interleaver delays by (i % 12) M bytes and we delay by
+ * (11 - i % 12) M, so everything comes out 11 M 12 = 2244 bytes late.
+ *
+ * Sync bytes always go through branch 0, which the interleaver doesn't
+ * delay, so they are still every 204 bytes at our input; that's how we
+ * find where packets start, and notice if we lose them again.  A packet
+ * is 17 bytes for each branch, and each branch's delay is a multiple of 17
+ * bytes, so the FIFOs are rings that move a whole packet's worth at a
+ * time.  */
+
+static int outer_is_sync(uint8_t c) {
+	return c == 0x47 || c == 0xB8;
+}
+
+void outer_deint_init(outer_deint_t *d, outer_output_t output, void *priv) {
+	memset(d, 0, sizeof(*d));
+	for (int j = 1; j < OUTER_I; j++)
+		d->base[j] = d->base[j - 1] + (OUTER_I - j) * OUTER_M;
+	d->output = output;
+	d->priv = priv;
+}
+
+/* Deinterleave one packet's worth of input, starting on a sync byte, into
+ * one packet of output.  */
+static void outer_deint_packet(outer_deint_t *d, const uint8_t *in, uint8_t *out) {
+	for (int j = 0; j < OUTER_I - 1; j++) {
+		uint8_t *ring = d->fifo + d->base[j] + d->chunk[j] * OUTER_M;
+
+		for (int r = 0; r < OUTER_M; r++) {
+			out[r * OUTER_I + j] = ring[r];
+			ring[r] = in[r * OUTER_I + j];
+		}
+		if (++d->chunk[j] == OUTER_I - 1 - j)
+			d->chunk[j] = 0;
+	}
+	for (int r = 0; r < OUTER_M; r++)
+		out[r * OUTER_I + OUTER_I - 1] = in[r * OUTER_I + OUTER_I - 1];
+}
+
+/* Look for OUTER_SYNC_MIN sync bytes, a packet apart, in the buffered
+ * input; returns where the first packet starts, or -1.  */
+static int outer_deint_search(outer_deint_t *d) {
+	for (int ofs = 0; ofs < OUTER_PKT; ofs++) {
+		int n = 0;
+
+		for (int k = 0; k < OUTER_SYNC_PKTS; k++)
+			n += outer_is_sync(d->buf[ofs + k * OUTER_PKT]);
+		if (n >= OUTER_SYNC_MIN)
+			return ofs;
+	}
+	return -1;
+}
+
+static void outer_deint_lock(outer_deint_t *d, int ofs) {
+	d->locked = 1;
+	d->misses = 0;
+	d->garbage = OUTER_DELAY / OUTER_PKT;
+	memset(d->chunk, 0, sizeof(d->chunk));
+	d->syncs++;
+	d->nbuf -= ofs;
+	memmove(d->buf, d->buf + ofs, d->nbuf);
+}
+
+/* Deinterleave whole packets from in, and hand them on a group at a time;
+ * returns the number of bytes used.  */
+static int outer_deint_run(outer_deint_t *d, const uint8_t *in, int len) {
+	int used = 0, nout = 0;
+
+	while (d->locked && len - used >= OUTER_PKT) {
+		const uint8_t *pkt = in + used;
+
+		if (outer_is_sync(pkt[0])) {
+			d->misses = 0;
+		} else if (++d->misses == OUTER_LOSS) {
+			d->locked = 0;
+			d->losses++;
+			break;
+		}
+
+		outer_deint_packet(d, pkt, d->out + nout);
+		used += OUTER_PKT;
+		if (d->garbage) {
+			d->garbage--;
+			continue;
+		}
+		d->packets++;
+		nout += OUTER_PKT;
+		if (nout == sizeof(d->out)) {
+			d->output(d->priv, d->out, nout);
+			nout = 0;
+		}
+	}
+	if (nout)
+		d->output(d->priv, d->out, nout);
+	return used;
+}
+
+void outer_deint_push(outer_deint_t *d, const uint8_t *in, int len) {
+	while (len > 0) {
+		/* Top up the buffer, and either find sync in it, or move on by
+		 * a packet.  */
+		if (!d->locked) {
+			int n = OUTER_SEARCH - d->nbuf < len ? OUTER_SEARCH - d->nbuf : len;
+
+			memcpy(d->buf + d->nbuf, in, n);
+			d->nbuf += n;
+			in += n;
+			len -= n;
+			if (d->nbuf < OUTER_SEARCH)
+				return;
+
+			int ofs = outer_deint_search(d);
+			if (ofs < 0) {
+				d->nbuf -= OUTER_PKT;
+				memmove(d->buf, d->buf + OUTER_PKT, d->nbuf);
+				continue;
+			}
+			outer_deint_lock(d, ofs);
+		}
+
+		/* Finish off the packet left over in the buffer, then go
+		 * straight from the input.  */
+		if (d->nbuf) {
+			int n = OUTER_PKT - d->nbuf % OUTER_PKT;
+			if (n == OUTER_PKT)
+				n = 0;
+			if (n > len)
+				n = len;
+			memcpy(d->buf + d->nbuf, in, n);
+			d->nbuf += n;
+			in += n;
+			len -= n;
+
+			int used = outer_deint_run(d, d->buf, d->nbuf);
+			d->nbuf -= used;
+			memmove(d->buf, d->buf + used, d->nbuf);
+			if (!d->locked || d->nbuf)
+				continue;
+		}
+
+		int used = outer_deint_run(d, in, len);
+		in += used;
+		len -= used;
+		if (d->locked) {
+			memcpy(d->buf, in, len);
+			d->nbuf = len;
+			return;
+		}
+	}
+}
+
+/* RS(204,188, t = 8), shortened from RS(255,239), section 4.3.2.  Nearly
+ * every packet is clean, so the thing that has to be fast is finding that
+ * out: the whole packet is divided by g(x) with a 16-byte remainder
+ * register, as two 64-bit words and one table lookup per byte.  Only if
+ * the remainder isn't zero do we work out syndromes from it, and go on to
+ * Berlekamp-Massey, Chien search and Forney.  */
+
+/* Remainder of the packet (first byte the highest order term) by g(x);
+ * zero for a codeword.  */
+static void rs_remainder(const uint8_t *pkt, uint64_t *lo, uint64_t *hi) {
+	uint64_t l = 0, h = 0;
+
+	for (int i = 0; i < RS_N; i++) {
+		uint8_t top = h >> 56;
+		h = (h << 8) | (l >> 56);
+		l = (l << 8) | pkt[i];
+		h ^= rs_ghi[top];
+		l ^= rs_glo[top];
+	}
+	*lo = l;
+	*hi = h;
+}
+
+/* Correct a packet in place; returns the number of bytes corrected, or -1
+ * if there were more errors than we can correct.  */
+int outer_rs_decode(uint8_t *pkt) {
+	uint64_t lo, hi;
+
+	outer_init_once();
+	rs_remainder(pkt, &lo, &hi);
+	if (!(lo | hi))
+		return 0;
+
+	/* S_i = c(a^i) = r(a^i), since g(a^i) = 0. */
+	uint8_t rem[RS_PARITY], s[RS_PARITY];
+	for (int k = 0; k < 8; k++) {
+		rem[k] = lo >> (8 * k);
+		rem[k + 8] = hi >> (8 * k);
+	}
+	for (int i = 0; i < RS_PARITY; i++) {
+		s[i] = 0;
+		for (int k = 0; k < RS_PARITY; k++)
+			if (rem[k])
+				s[i] ^= rs_exp[(rs_log[rem[k]] + i * k) % 255];
+	}
+
+	/* Berlekamp-Massey, for the error locator lambda(x). */
+	uint8_t lambda[RS_PARITY + 1] = { 1 }, prev[RS_PARITY + 1] = { 1 }, tmp[RS_PARITY + 1];
+	int l = 0, m = 1;
+	uint8_t b = 1;
+
+	for (int n = 0; n < RS_PARITY; n++) {
+		uint8_t d = s[n];
+		for (int i = 1; i <= l; i++)
+			d ^= rs_mul(lambda[i], s[n - i]);
+		if (!d) {
+			m++;
+			continue;
+		}
+
+		uint8_t coef = rs_div(d, b);
+		memcpy(tmp, lambda, sizeof(lambda));
+		for (int i = 0; i + m <= RS_PARITY; i++)
+			lambda[i + m] ^= rs_mul(coef, prev[i]);
+		if (2 * l <= n) {
+			l = n + 1 - l;
+			memcpy(prev, tmp, sizeof(prev));
+			b = d;
+			m = 1;
+		} else
+			m++;
+	}
+	if (l > RS_T)
+		return -1;
+
+	/* omega(x) = s(x) lambda(x) mod x^16 */
+	uint8_t omega[RS_PARITY];
+	for (int i = 0; i < RS_PARITY; i++) {
+		omega[i] = 0;
+		for (int j = 0; j <= i && j <= l; j++)
+			omega[i] ^= rs_mul(lambda[j], s[i - j]);
+	}
+
+	/* Chien search, over the positions that are actually sent: byte i is
+	 * the coefficient of x^e, e = 203 - i, and has locator X = a^e.  */
+	int pos[RS_T], nroots = 0;
+	uint8_t mag[RS_T];
+	for (int e = 0; e < RS_N; e++) {
+		int xinv = (255 - e) % 255; /* log of X^-1 */
+		uint8_t sum = 0, dsum = 0, osum = 0;
+
+		for (int j = 0; j <= l; j++) {
+			if (!lambda[j])
+				continue;
+			uint8_t t = rs_exp[(rs_log[lambda[j]] + xinv * j) % 255];
+			sum ^= t;
+			if (j & 1)
+				dsum ^= t; /* x lambda'(x) */
+		}
+		if (sum)
+			continue;
+		if (nroots == RS_T)
+			return -1;
+
+		/* Forney, with the first root at a^0: the error value is
+		 * X omega(X^-1) / lambda'(X^-1) = omega(X^-1) / (X^-1 lambda'(X^-1)). */
+		for (int j = 0; j < RS_PARITY; j++)
+			if (omega[j])
+				osum ^= rs_exp[(rs_log[omega[j]] + xinv * j) % 255];
+		if (!dsum || !osum)
+			return -1;
+		pos[nroots] = RS_N - 1 - e;
+		mag[nroots] = rs_div(osum, dsum);
+		nroots++;
+	}
+	if (nroots != l)
+		return -1;
+
+	for (int i = 0; i < nroots; i++)
+		pkt[pos[i]] ^= mag[i];
+	return nroots;
+}
+
+/* An uncorrectable packet keeps its sync byte, if we know which one it
+ * should be, and gets transport_error_indicator set.  The PRBS is still to
+ * be taken off, so the bit we set is the one that will come out as a 1.  */
+void outer_rs_fail(uint8_t *pkt, int group) {
+	outer_init_once();
+	if (group < 0)
+		return;
+	pkt[0] = group ? 0x47 : 0xB8;
+	pkt[1] = (pkt[1] & 0x7F) | (~prbs_mask[group * OUTER_TS + 1] & 0x80);
+}
+
+/* Where a packet falls in its group of 8, given where the one before it
+ * did (-1 if we don't know yet).  Only trust the sync byte of a packet RS
+ * couldn't correct if we have nothing better.  */
+int outer_next_group(int group, const uint8_t *pkt, int trusted) {
+	if (pkt[0] == 0xB8 && (trusted || group < 0))
+		return 0;
+	if (group >= 0)
+		return (group + 1) % OUTER_GROUP;
+	return -1;
+}
+
+/* Take the PRBS off a packet in place, and turn its sync byte back into
+ * 0x47.  */
+void outer_descramble(uint8_t *pkt, int group) {
+	const uint8_t *mask = prbs_mask + group * OUTER_TS;
+
+	outer_init_once();
+	for (int i = 1; i < OUTER_TS; i++)
+		pkt[i] ^= mask[i];
+	pkt[0] = 0x47;
+}
+
+/* The whole chain: each group from the deinterleaver is corrected and
+ * descrambled in place, squeezed down to 188-byte packets, and passed
+ * on.  */
+static void outer_decoder_group(void *priv, uint8_t *buf, int len) {
+	outer_decoder_t *od = priv;
+	uint8_t *out = buf;
+
+	for (uint8_t *pkt = buf; pkt < buf + len; pkt += OUTER_PKT) {
+		int fixed = outer_rs_decode(pkt);
+
+		od->rs_packets++;
+		if (fixed > 0) {
+			od->rs_corrected++;
+			od->rs_symbols += fixed;
+		}
+		od->group = outer_next_group(od->group, pkt, fixed >= 0);
+		if (fixed < 0) {
+			od->rs_failed++;
+			outer_rs_fail(pkt, od->group);
+		}
+		if (od->group < 0) {
+			od->dropped++;
+			continue;
+		}
+
+		outer_descramble(pkt, od->group);
+		if (out != pkt)
+			memmove(out, pkt, OUTER_TS);
+		out += OUTER_TS;
+		od->packets++;
+	}
+	if (out > buf && od->output)
+		od->output(od->priv, buf, out - buf);
+}
+
+void outer_decoder_init(outer_decoder_t *od, outer_output_t output, void *priv) {
+	outer_init_once();
+	memset(od, 0, sizeof(*od));
+	outer_deint_init(&od->deint, outer_decoder_group, od);
+	od->group = -1;
+	od->output = output;
+	od->priv = priv;
+}
+
+/* Bytes from the inner decoder, in any amounts. */
+void outer_decoder_push(outer_decoder_t *od, const uint8_t *in, int len) {
+	outer_deint_push(&od->deint, in, len);
+}
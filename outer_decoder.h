@@ -0,0 +1,86 @@
+#ifndef OUTER_DECODER_H
+#define OUTER_DECODER_H
+
+#include <stdint.h>
+
+/* Outer decoder for DVB-T, section 4.3.1 - 4.3.2: bytes from the inner
+ * decoder in, 188-byte transport stream packets out.  Three stages, any of
+ * which can also be used on its own:
+ *
+ *   - the convolutional deinterleaver (I = 12, M = 17), which also finds
+ *     where packets start, and keeps track of it;
+ *   - RS(204,188, t = 8);
+ *   - energy dispersal removal.
+ *
+ * outer_decoder_t runs all three in one pass: the deinterleaver hands over
+ * up to a group of 8 packets at a time, which are corrected, descrambled
+ * and passed on while they're still in cache.  */
+
+#define OUTER_I 12
+#define OUTER_M 17
+#define OUTER_PKT (OUTER_I * OUTER_M) /* 204 */
+#define OUTER_TS 188
+#define OUTER_GROUP 8 /* packets per PRBS period */
+#define OUTER_FIFO (OUTER_M * OUTER_I * (OUTER_I - 1) / 2) /* 1122 */
+#define OUTER_DELAY (OUTER_M * OUTER_I * (OUTER_I - 1)) /* 2244 */
+
+/* To lock, OUTER_SYNC_MIN of OUTER_SYNC_PKTS packets in a row must start
+ * with a sync byte; OUTER_LOSS misses in a row, and we look again.  */
+#define OUTER_SYNC_PKTS 8
+#define OUTER_SYNC_MIN 7
+#define OUTER_LOSS 4
+#define OUTER_SEARCH (OUTER_SYNC_PKTS * OUTER_PKT + OUTER_PKT - 1)
+
+/* The buffer belongs to the stage that calls this, and is only good until
+ * it returns; the receiver may work on it in place.  */
+typedef void (*outer_output_t)(void *priv, uint8_t *buf, int len);
+
+typedef struct outer_deint {
+	uint8_t fifo[OUTER_FIFO]; /* branch j's ring at fifo + base[j] */
+	int base[OUTER_I];
+	int chunk[OUTER_I]; /* which M bytes of each ring are oldest */
+
+	int locked;
+	int misses; /* packets in a row without a sync byte */
+	int garbage; /* packets still to come out before the FIFOs are full */
+
+	uint8_t buf[OUTER_SEARCH]; /* input not yet deinterleaved */
+	int nbuf;
+	uint8_t out[OUTER_GROUP * OUTER_PKT];
+
+	outer_output_t output;
+	void *priv;
+
+	/* Statistics */
+	int64_t packets;
+	int syncs; /* times we've locked */
+	int losses; /* times we've lost it again */
+} outer_deint_t;
+
+typedef struct outer_decoder {
+	outer_deint_t deint;
+	int group; /* position of the last packet in its group of 8, or -1 */
+
+	outer_output_t output;
+	void *priv;
+
+	/* Statistics */
+	int64_t rs_packets;
+	int64_t rs_corrected; /* packets with errors, all corrected */
+	int64_t rs_symbols; /* bytes corrected */
+	int64_t rs_failed; /* packets with too many errors */
+	int64_t dropped; /* packets before the first group start */
+	int64_t packets; /* passed on */
+} outer_decoder_t;
+
+/* outer_decoder.c */
+extern void outer_deint_init(outer_deint_t *d, outer_output_t output, void *priv);
+extern void outer_deint_push(outer_deint_t *d, const uint8_t *in, int len);
+extern int outer_rs_decode(uint8_t *pkt);
+extern void outer_rs_fail(uint8_t *pkt, int group);
+extern int outer_next_group(int group, const uint8_t *pkt, int trusted);
+extern void outer_descramble(uint8_t *pkt, int group);
+extern void outer_decoder_init(outer_decoder_t *od, outer_output_t output, void *priv);
+extern void outer_decoder_push(outer_decoder_t *od, const uint8_t *in, int len);
+
+#endif
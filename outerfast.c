@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "outer_decoder.h"
+#include "ts_sink.h"
+
+/* The whole outer decoder in one process: bytes from the inner decoder
+ * in on stdin, the transport stream out.  Equivalent to outer | rs | prbs,
+ * without the pipes.  */
+
+int main(int argc, char **argv) {
+	static uint8_t inbuf[65536];
+	static outer_decoder_t od;
+	static ts_sink_t sink;
+	const char *dest = "-", *pids = NULL;
+	ssize_t len;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:p:")) != -1) {
+		switch (opt) {
+		case 'o':
+			dest = optarg;
+			break;
+		case 'p':
+			pids = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o output] [-p pid,...] < input\n", argv[0]);
+			fprintf(stderr, "  -o: file or pipe to write to, udp:PORT for 127.0.0.1, or - for stdout (default)\n");
+			fprintf(stderr, "  -p: only pass on these PIDs\n");
+			return 1;
+		}
+	}
+
+	if (ts_sink_open(&sink, dest) < 0)
+		return 1;
+	if (pids && ts_sink_allow_list(&sink, pids) < 0) {
+		fprintf(stderr, "%s: bad PID list %s\n", argv[0], pids);
+		return 1;
+	}
+
+	outer_decoder_init(&od, ts_sink_output, &sink);
+	while ((len = read(0, inbuf, sizeof(inbuf))) > 0)
+		outer_decoder_push(&od, inbuf, len);
+	ts_sink_close(&sink);
+
+	fprintf(stderr, "Deinterleaver: %lld packets; locked %d times, lost sync %d times.\n",
+	        (long long)od.deint.packets, od.deint.syncs, od.deint.losses);
+	fprintf(stderr, "RS: %lld packets: %lld corrected (%lld bytes), %lld uncorrectable.\n",
+	        (long long)od.rs_packets, (long long)od.rs_corrected, (long long)od.rs_symbols,
+	        (long long)od.rs_failed);
+	fprintf(stderr, "%lld packets out, %lld dropped before the first group start.\n",
+	        (long long)od.packets, (long long)od.dropped);
+	ts_sink_report(&sink);
+	return 0;
+}
@@ -1,37 +1,66 @@
 #include <stdint.h>
+#include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <stdio.h>
+#include "outer_decoder.h"
+#include "ts_sink.h"
 
-uint8_t byte_from(uint32_t *lfsr) {
-	uint8_t out = 0;
-	for (int i = 7; i >= 0; i--) {
-		int b = (*lfsr & 1) ^ ((*lfsr >> 1) & 1);
-		*lfsr = (*lfsr >> 1) | (b << 14);
-		out |= b << i;
+/* Energy dispersal removal on its own: 188-byte packets in on stdin, the
+ * transport stream out.  Packets before the first group start are no use
+ * to anyone, so they're dropped.  */
+
+#define PRBS_BATCH 348 /* packets per read */
+
+int main(int argc, char **argv) {
+	static uint8_t buf[PRBS_BATCH * OUTER_TS];
+	static ts_sink_t sink;
+	const char *dest = "-", *pids = NULL;
+	int have = 0, group = -1;
+	ssize_t len;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:p:")) != -1) {
+		switch (opt) {
+		case 'o':
+			dest = optarg;
+			break;
+		case 'p':
+			pids = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o output] [-p pid,...] < input\n", argv[0]);
+			fprintf(stderr, "  -o: file or pipe to write to, udp:PORT for 127.0.0.1, or - for stdout (default)\n");
+			fprintf(stderr, "  -p: only pass on these PIDs\n");
+			return 1;
+		}
 	}
-	return out;
-}
 
-void main() {
-	uint8_t pkt[188];
-	int init = 0;
-	uint32_t lfsr = 0;
-	
-	while (read(0, pkt, 188) == 188) {
-		if (!init && pkt[0] != 0xB8)
-			continue;
-		init = 1;
-		
-		if (pkt[0] == 0xB8) {
-			lfsr = 0b100101010000000;
-			pkt[0] = 0x47;
-		} else
-			byte_from(&lfsr);
-			
-		for (int i = 1; i < 188; i++) {
-			pkt[i] ^= byte_from(&lfsr);
+	if (ts_sink_open(&sink, dest) < 0)
+		return 1;
+	if (pids && ts_sink_allow_list(&sink, pids) < 0) {
+		fprintf(stderr, "%s: bad PID list %s\n", argv[0], pids);
+		return 1;
+	}
+
+	while ((len = read(0, buf + have, sizeof(buf) - have)) > 0) {
+		int npkts = (have + len) / OUTER_TS;
+
+		have += len;
+		for (int p = 0; p < npkts; p++) {
+			uint8_t *pkt = buf + p * OUTER_TS;
+
+			group = outer_next_group(group, pkt, 1);
+			if (group < 0)
+				continue;
+			outer_descramble(pkt, group);
+			ts_sink_push(&sink, pkt, OUTER_TS);
 		}
-		
-		write(1, pkt, 188);
+
+		have -= npkts * OUTER_TS;
+		memmove(buf, buf + npkts * OUTER_TS, have);
 	}
+	ts_sink_close(&sink);
+	ts_sink_report(&sink);
+	return 0;
 }
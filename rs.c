@@ -1,10 +1,56 @@
 #include <stdint.h>
-#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <stdio.h>
+#include "outer_decoder.h"
 
-void main() {
-	uint8_t pkt[204];
-	while (read(0, pkt, 204) == 204) {
-		write(1, pkt, 188);
+/* RS(204,188) decoder on its own: deinterleaved 204-byte packets in on
+ * stdin, corrected 188-byte packets (still energy-dispersed) out on
+ * stdout.  */
+
+#define RS_BATCH 256 /* packets per read */
+
+int main(void) {
+	static uint8_t inbuf[RS_BATCH * OUTER_PKT], outbuf[RS_BATCH * OUTER_TS];
+	int64_t packets = 0, corrected = 0, symbols = 0, failed = 0;
+	int have = 0, group = -1;
+	ssize_t len;
+
+	while ((len = read(0, inbuf + have, sizeof(inbuf) - have)) > 0) {
+		int npkts = (have + len) / OUTER_PKT;
+		uint8_t *out = outbuf;
+
+		have += len;
+		for (int p = 0; p < npkts; p++) {
+			uint8_t *pkt = inbuf + p * OUTER_PKT;
+			int fixed = outer_rs_decode(pkt);
+
+			packets++;
+			if (fixed > 0) {
+				corrected++;
+				symbols += fixed;
+			}
+			group = outer_next_group(group, pkt, fixed >= 0);
+			if (fixed < 0) {
+				failed++;
+				outer_rs_fail(pkt, group);
+			}
+			memcpy(out, pkt, OUTER_TS);
+			out += OUTER_TS;
+		}
+
+		for (uint8_t *p = outbuf; p < out; ) {
+			ssize_t n = write(1, p, out - p);
+			if (n <= 0)
+				return 1;
+			p += n;
+		}
+
+		have -= npkts * OUTER_PKT;
+		memmove(inbuf, inbuf + npkts * OUTER_PKT, have);
 	}
+
+	fprintf(stderr, "%lld packets: %lld corrected (%lld bytes), %lld uncorrectable.\n",
+	        (long long)packets, (long long)corrected, (long long)symbols, (long long)failed);
+	return 0;
 }
@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ts_sink.h"
+
+/* Open a sink on dest: "-" for stdout, "udp:PORT" for UDP to
+ * 127.0.0.1:PORT, and anything else is a file (or named pipe) to create.
+ * Returns 0, or -1 if that can't be done.  */
+int ts_sink_open(ts_sink_t *s, const char *dest) {
+	memset(s, 0, sizeof(*s));
+	memset(s->cc, -1, sizeof(s->cc));
+	s->unit = TS_SINK_BUF;
+
+	if (!strcmp(dest, "-")) {
+		s->fd = 1;
+		return 0;
+	}
+
+	if (!strncmp(dest, "udp:", 4)) {
+		struct sockaddr_in sin;
+		int port = atoi(dest + 4);
+
+		if (port <= 0 || port > 65535) {
+			fprintf(stderr, "ts_sink: bad UDP port in %s\n", dest);
+			return -1;
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (s->fd < 0 || connect(s->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+			perror("ts_sink: udp");
+			if (s->fd >= 0)
+				close(s->fd);
+			return -1;
+		}
+		s->udp = 1;
+		s->owned = 1;
+		s->unit = TS_UDP_PKTS * TS_PKT;
+		return 0;
+	}
+
+	s->fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (s->fd < 0) {
+		perror(dest);
+		return -1;
+	}
+	s->owned = 1;
+	return 0;
+}
+
+/* Pass on pid; once any PID has been allowed, nothing else is.  */
+void ts_sink_allow(ts_sink_t *s, int pid) {
+	s->allow[pid / 64] |= 1ULL << (pid % 64);
+	s->filter = 1;
+}
+
+/* Allow a comma-separated list of PIDs, in decimal or 0x hex; returns -1
+ * if any of them isn't one.  */
+int ts_sink_allow_list(ts_sink_t *s, const char *list) {
+	while (*list) {
+		char *end;
+		long pid = strtol(list, &end, 0);
+
+		if (end == list || pid < 0 || pid >= TS_PIDS || (*end && *end != ','))
+			return -1;
+		ts_sink_allow(s, pid);
+		list = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* Write out everything collected so far.  A failed write loses the
+ * packets, but not the stream: we carry on with the next batch.  */
+void ts_sink_flush(ts_sink_t *s) {
+	uint8_t *p = s->buf;
+
+	while (p < s->buf + s->nbuf) {
+		int len = s->buf + s->nbuf - p;
+		ssize_t n;
+
+		if (s->udp && len > TS_UDP_PKTS * TS_PKT)
+			len = TS_UDP_PKTS * TS_PKT;
+		n = s->udp ? send(s->fd, p, len, 0) : write(s->fd, p, len);
+		if (n <= 0) {
+			s->write_errors++;
+			if (!s->udp)
+				break;
+			n = len; /* drop the datagram, and try the next */
+		}
+		p += n;
+	}
+	s->nbuf = 0;
+}
+
+/* Continuity counter check, ISO/IEC 13818-1 section 2.4.3.3: the counter
+ * goes up by one with each packet that has a payload, and stays put on
+ * those that don't, and on a single repeat of a packet.  A second repeat
+ * in a row is an error, so a stuck counter doesn't go unnoticed.  A
+ * discontinuity indicator means the next value could be anything.  */
+static void ts_sink_check(ts_sink_t *s, const uint8_t *pkt) {
+	int pid = ((pkt[1] & 0x1F) << 8) | pkt[2];
+	int afc = (pkt[3] >> 4) & 3;
+	int cc = pkt[3] & 0xF;
+	int last = s->cc[pid];
+
+	if (pid == TS_NULL_PID)
+		return;
+	if (last >= 0 && !((afc & 2) && pkt[4] && (pkt[5] & 0x80))) {
+		int ok, repeat = (afc & 1) && cc == last;
+
+		if (afc & 1)
+			ok = cc == ((last + 1) & 0xF) || (repeat && !s->repeated[pid]);
+		else
+			ok = cc == last;
+		if (!ok) {
+			s->cc_errors[pid]++;
+			s->cc_total++;
+		}
+		if (afc & 1)
+			s->repeated[pid] = repeat;
+	} else {
+		s->repeated[pid] = 0;
+	}
+	s->cc[pid] = cc;
+}
+
+/* Whole packets in; they may be anywhere, and needn't stay around after
+ * this returns.  */
+void ts_sink_push(ts_sink_t *s, const uint8_t *pkts, int len) {
+	for (const uint8_t *pkt = pkts; pkt + TS_PKT <= pkts + len; pkt += TS_PKT) {
+		int pid = ((pkt[1] & 0x1F) << 8) | pkt[2];
+
+		s->packets++;
+		if (pkt[0] != 0x47) {
+			s->sync_errors++;
+			continue;
+		}
+		if (pkt[1] & 0x80)
+			s->tei++; /* the header can't be trusted, so don't check it */
+		else
+			ts_sink_check(s, pkt);
+
+		if (s->filter && !(s->allow[pid / 64] & (1ULL << (pid % 64))))
+			continue;
+		memcpy(s->buf + s->nbuf, pkt, TS_PKT);
+		s->nbuf += TS_PKT;
+		s->passed++;
+		if (s->nbuf >= s->unit)
+			ts_sink_flush(s);
+	}
+}
+
+/* For use as an output callback, with the sink as priv. */
+void ts_sink_output(void *priv, uint8_t *buf, int len) {
+	ts_sink_push(priv, buf, len);
+}
+
+void ts_sink_close(ts_sink_t *s) {
+	ts_sink_flush(s);
+	if (s->owned)
+		close(s->fd);
+	s->fd = -1;
+}
+
+void ts_sink_report(const ts_sink_t *s) {
+	fprintf(stderr, "TS: %lld packets in, %lld out; %lld bad sync bytes, %lld with errors, "
+	        "%lld continuity errors.\n", (long long)s->packets, (long long)s->passed,
+	        (long long)s->sync_errors, (long long)s->tei, (long long)s->cc_total);
+	for (int pid = 0; pid < TS_PIDS; pid++)
+		if (s->cc_errors[pid])
+			fprintf(stderr, "  PID 0x%04x: %u continuity errors\n", pid, s->cc_errors[pid]);
+	if (s->write_errors)
+		fprintf(stderr, "  %lld writes failed\n", (long long)s->write_errors);
+}
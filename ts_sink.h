@@ -0,0 +1,54 @@
+#ifndef TS_SINK_H
+#define TS_SINK_H
+
+#include <stdint.h>
+
+/* The end of the chain: transport stream packets out to a file, a pipe or
+ * a UDP port on localhost, optionally only those on a list of PIDs.
+ * Packets are collected into large writes (or, for UDP, the usual 7 per
+ * datagram) rather than going out one at a time.  On the way through,
+ * every PID's continuity counter is checked, as a cheap measure of how
+ * much of the mux is getting through intact.  */
+
+#define TS_PKT 188
+#define TS_PIDS 8192
+#define TS_NULL_PID 0x1FFF
+#define TS_SINK_BUF (348 * TS_PKT) /* about 64 KB */
+#define TS_UDP_PKTS 7 /* per datagram */
+
+typedef struct ts_sink {
+	int fd;
+	int udp;
+	int owned; /* we opened fd, so close it */
+
+	uint8_t buf[TS_SINK_BUF];
+	int nbuf;
+	int unit; /* bytes to collect before writing */
+
+	uint64_t allow[TS_PIDS / 64]; /* PIDs to pass on, if filter */
+	int filter;
+
+	int8_t cc[TS_PIDS]; /* last continuity counter seen on each PID, or -1 */
+	uint8_t repeated[TS_PIDS]; /* and whether that packet was a repeat */
+
+	/* Statistics */
+	int64_t packets; /* in */
+	int64_t passed; /* out */
+	int64_t sync_errors; /* packets that didn't start with 0x47 */
+	int64_t tei; /* packets with transport_error_indicator set */
+	int64_t cc_total; /* continuity errors on all PIDs */
+	uint32_t cc_errors[TS_PIDS];
+	int64_t write_errors; /* writes or datagrams that failed */
+} ts_sink_t;
+
+/* ts_sink.c */
+extern int ts_sink_open(ts_sink_t *s, const char *dest);
+extern void ts_sink_allow(ts_sink_t *s, int pid);
+extern int ts_sink_allow_list(ts_sink_t *s, const char *list);
+extern void ts_sink_push(ts_sink_t *s, const uint8_t *pkts, int len);
+extern void ts_sink_output(void *priv, uint8_t *buf, int len);
+extern void ts_sink_flush(ts_sink_t *s);
+extern void ts_sink_close(ts_sink_t *s);
+extern void ts_sink_report(const ts_sink_t *s);
+
+#endif
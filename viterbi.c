@@ -0,0 +1,948 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "viterbi.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VITERBI_X86
+#endif
+
+/* Path metrics are 16 bits wide, so every so often we subtract the best
+ * metric back out of all of them.  The spread between states is bounded by
+ * the constraint length, so even with soft branch metrics (at most 510 per
+ * step) this is plenty of headroom.  */
+#define VITERBI_RENORM 32
+
+/* Shared by every decoder, and never written after viterbi_init_tables(). */
+static uint8_t xtab[VITERBI_STATES * 2];
+static uint8_t ytab[VITERBI_STATES * 2];
+
+/* Branch metrics for each combination of (hasx, x, hasy, y), laid out for
+ * the ACS: [combination][even/inp 0, odd/inp 0, even/inp 1, odd/inp 1][n % 32] */
+#define VITERBI_CMB(hasx, x, hasy, y) (((hasx) << 3) | ((x) << 2) | ((hasy) << 1) | (y))
+static int16_t bmtab[16][4][VITERBI_HALF] __attribute__((aligned(32)));
+
+/* For soft input, the sign that each expected output bit puts on its LLR,
+ * in the same layout: +1 if the branch expects a 1, -1 if it expects a 0.  */
+static int16_t xsgn[4][VITERBI_HALF] __attribute__((aligned(32)));
+static int16_t ysgn[4][VITERBI_HALF] __attribute__((aligned(32)));
+
+typedef uint64_t (*viterbi_acs_t)(const int16_t *old, int16_t *new, const int16_t (*bm)[VITERBI_HALF]);
+static viterbi_acs_t viterbi_acs;
+
+/* Register exchange: each new state's register is its winning
+ * predecessor's, shifted along, with the new state's input bit on the end. */
+typedef void (*viterbi_rx_t)(const uint64_t *old, uint64_t *new, uint64_t dec);
+static viterbi_rx_t viterbi_rx;
+
+/* Select with masks rather than branches; the decisions are about as
+ * unpredictable as branches get.  */
+static void viterbi_rx_generic(const uint64_t *restrict old, uint64_t *restrict new, uint64_t dec) {
+	for (int j = 0; j < VITERBI_HALF; j++) {
+		uint64_t even = old[2 * j], odd = old[2 * j + 1];
+		uint64_t m0 = -((dec >> j) & 1);
+		uint64_t m1 = -((dec >> (j + VITERBI_HALF)) & 1);
+		new[j] = ((odd & m0) | (even & ~m0)) << 1;
+		new[j + VITERBI_HALF] = (((odd & m1) | (even & ~m1)) << 1) | 1;
+	}
+}
+
+/* The reference add-compare-select: on a tie, the even predecessor wins. */
+static uint64_t viterbi_acs_generic(const int16_t *old, int16_t *new, const int16_t (*bm)[VITERBI_HALF]) {
+	uint64_t dec = 0;
+
+	for (int j = 0; j < VITERBI_HALF; j++) {
+		for (int inp = 0; inp < 2; inp++) {
+			int m0 = old[2 * j]     + bm[inp * 2 + 0][j];
+			int m1 = old[2 * j + 1] + bm[inp * 2 + 1][j];
+			int n = j | (inp << VITERBI_K);
+
+			dec |= (uint64_t)(m1 < m0) << n;
+			new[n] = (m1 < m0) ? m1 : m0;
+		}
+	}
+
+	return dec;
+}
+
+#ifdef VITERBI_X86
+/* Split 16 metrics into the 8 even-numbered and 8 odd-numbered states;
+ * metrics are always non-negative, so the signed packs can't saturate.
+ *
+ * The metrics and registers live in the caller's viterbi_t, which needn't
+ * be aligned, so they're loaded and stored unaligned; the branch metric
+ * tables are ours, and are.  */
+static inline __m128i viterbi_even_sse2(__m128i a, __m128i b) {
+	return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+	                       _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
+
+static inline __m128i viterbi_odd_sse2(__m128i a, __m128i b) {
+	return _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+}
+
+static uint64_t viterbi_acs_sse2(const int16_t *old, int16_t *new, const int16_t (*bm)[VITERBI_HALF]) {
+	uint64_t dec = 0;
+
+	for (int j = 0; j < VITERBI_HALF; j += 16) {
+		__m128i d0[2], d1[2];
+
+		for (int h = 0; h < 2; h++) {
+			int jj = j + h * 8;
+			__m128i a = _mm_loadu_si128((const __m128i *)&old[2 * jj]);
+			__m128i b = _mm_loadu_si128((const __m128i *)&old[2 * jj + 8]);
+			__m128i even = viterbi_even_sse2(a, b);
+			__m128i odd = viterbi_odd_sse2(a, b);
+
+			/* input 0 -> state jj, input 1 -> state jj + 32 */
+			__m128i m00 = _mm_adds_epi16(even, _mm_load_si128((const __m128i *)&bm[0][jj]));
+			__m128i m01 = _mm_adds_epi16(odd,  _mm_load_si128((const __m128i *)&bm[1][jj]));
+			__m128i m10 = _mm_adds_epi16(even, _mm_load_si128((const __m128i *)&bm[2][jj]));
+			__m128i m11 = _mm_adds_epi16(odd,  _mm_load_si128((const __m128i *)&bm[3][jj]));
+
+			_mm_storeu_si128((__m128i *)&new[jj], _mm_min_epi16(m00, m01));
+			_mm_storeu_si128((__m128i *)&new[jj + VITERBI_HALF], _mm_min_epi16(m10, m11));
+			d0[h] = _mm_cmpgt_epi16(m00, m01);
+			d1[h] = _mm_cmpgt_epi16(m10, m11);
+		}
+
+		dec |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(d0[0], d0[1])) << j;
+		dec |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(d1[0], d1[1])) << (j + VITERBI_HALF);
+	}
+
+	return dec;
+}
+
+__attribute__((target("avx2")))
+static uint64_t viterbi_acs_avx2(const int16_t *old, int16_t *new, const int16_t (*bm)[VITERBI_HALF]) {
+	__m256i d0[2], d1[2];
+
+	for (int h = 0; h < 2; h++) {
+		int jj = h * 16;
+		__m256i a = _mm256_loadu_si256((const __m256i *)&old[2 * jj]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&old[2 * jj + 16]);
+
+		/* The packs work within each 128-bit lane, so put the quadwords
+		 * back in order afterwards.  */
+		__m256i even = _mm256_permute4x64_epi64(
+			_mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16),
+			                   _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16)),
+			_MM_SHUFFLE(3, 1, 2, 0));
+		__m256i odd = _mm256_permute4x64_epi64(
+			_mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16)),
+			_MM_SHUFFLE(3, 1, 2, 0));
+
+		__m256i m00 = _mm256_adds_epi16(even, _mm256_load_si256((const __m256i *)&bm[0][jj]));
+		__m256i m01 = _mm256_adds_epi16(odd,  _mm256_load_si256((const __m256i *)&bm[1][jj]));
+		__m256i m10 = _mm256_adds_epi16(even, _mm256_load_si256((const __m256i *)&bm[2][jj]));
+		__m256i m11 = _mm256_adds_epi16(odd,  _mm256_load_si256((const __m256i *)&bm[3][jj]));
+
+		_mm256_storeu_si256((__m256i *)&new[jj], _mm256_min_epi16(m00, m01));
+		_mm256_storeu_si256((__m256i *)&new[jj + VITERBI_HALF], _mm256_min_epi16(m10, m11));
+		d0[h] = _mm256_cmpgt_epi16(m00, m01);
+		d1[h] = _mm256_cmpgt_epi16(m10, m11);
+	}
+
+	uint32_t dec0 = _mm256_movemask_epi8(
+		_mm256_permute4x64_epi64(_mm256_packs_epi16(d0[0], d0[1]), _MM_SHUFFLE(3, 1, 2, 0)));
+	uint32_t dec1 = _mm256_movemask_epi8(
+		_mm256_permute4x64_epi64(_mm256_packs_epi16(d1[0], d1[1]), _MM_SHUFFLE(3, 1, 2, 0)));
+
+	return dec0 | ((uint64_t)dec1 << VITERBI_HALF);
+}
+
+__attribute__((target("avx2")))
+static void viterbi_rx_avx2(const uint64_t *old, uint64_t *new, uint64_t dec) {
+	const __m256i bits = _mm256_set_epi64x(8, 4, 2, 1);
+	const __m256i one = _mm256_set1_epi64x(1);
+
+	for (int j = 0; j < VITERBI_HALF; j += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)&old[2 * j]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&old[2 * j + 4]);
+		__m256i even = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i odd = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i m0 = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(dec >> j), bits), bits);
+		__m256i m1 = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(dec >> (j + VITERBI_HALF)), bits), bits);
+
+		_mm256_storeu_si256((__m256i *)&new[j],
+			_mm256_slli_epi64(_mm256_blendv_epi8(even, odd, m0), 1));
+		_mm256_storeu_si256((__m256i *)&new[j + VITERBI_HALF],
+			_mm256_or_si256(_mm256_slli_epi64(_mm256_blendv_epi8(even, odd, m1), 1), one));
+	}
+}
+#endif
+
+/* Kernels, in order of preference; all of them give exactly the same
+ * results.  */
+static const struct {
+	const char *name;
+	viterbi_acs_t acs;
+	viterbi_rx_t rx;
+	int avx2; /* needs AVX2 */
+} viterbi_kernels[] = {
+	{ "generic", viterbi_acs_generic, viterbi_rx_generic, 0 },
+#ifdef VITERBI_X86
+	{ "sse2",    viterbi_acs_sse2,    viterbi_rx_generic, 0 },
+	{ "avx2",    viterbi_acs_avx2,    viterbi_rx_avx2,    1 },
+#endif
+	{ NULL },
+};
+
+const char *viterbi_kernel_name(int i) {
+	return viterbi_kernels[i].name;
+}
+
+static int viterbi_use_kernel(const char *name) {
+	for (int i = 0; viterbi_kernels[i].name; i++) {
+		if (strcmp(viterbi_kernels[i].name, name))
+			continue;
+#ifdef VITERBI_X86
+		if (viterbi_kernels[i].avx2 && !__builtin_cpu_supports("avx2"))
+			return 0;
+#endif
+		viterbi_acs = viterbi_kernels[i].acs;
+		viterbi_rx = viterbi_kernels[i].rx;
+		return 1;
+	}
+	return 0;
+}
+
+/* Puncturing, section 4.3.3: for each code rate, numbered as in the TPS,
+ * which of X and Y are sent at each step of the period.  Within a step, X
+ * goes out before Y.
+ *
+ * The more that's punctured, the longer the survivors take to merge, so
+ * the traceback depth goes up with the rate.  Each is about where going
+ * any deeper stops helping, from viterbi_bench with soft input.  */
+#define VITERBI_MAX_PERIOD 7
+
+typedef struct viterbi_rate {
+	const char *name;
+	int period; /* trellis steps per period */
+	const char *x, *y;
+	int depth; /* traceback, in trellis steps; at most VITERBI_MAX_DEPTH */
+
+	/* Worked out from x and y by viterbi_init_rates() */
+	int nbits; /* coded bits per period */
+	int8_t xsrc[VITERBI_MAX_PERIOD]; /* which coded bit is X at each step, or -1 */
+	int8_t ysrc[VITERBI_MAX_PERIOD];
+} viterbi_rate_t;
+
+static viterbi_rate_t viterbi_rates[VITERBI_RATES] = {
+	{ .name = "1/2", .period = 1, .x = "1",       .y = "1",       .depth = 32 },
+	{ .name = "2/3", .period = 2, .x = "10",      .y = "11",      .depth = 64 },
+	{ .name = "3/4", .period = 3, .x = "101",     .y = "110",     .depth = 96 },
+	{ .name = "5/6", .period = 5, .x = "10101",   .y = "11010",   .depth = 128 },
+	{ .name = "7/8", .period = 7, .x = "1000101", .y = "1111010", .depth = 128 },
+};
+
+static void viterbi_init_rates() {
+	for (int r = 0; r < VITERBI_RATES; r++) {
+		viterbi_rate_t *p = &viterbi_rates[r];
+
+		p->nbits = 0;
+		for (int i = 0; i < p->period; i++) {
+			p->xsrc[i] = p->x[i] == '1' ? p->nbits++ : -1;
+			p->ysrc[i] = p->y[i] == '1' ? p->nbits++ : -1;
+		}
+	}
+}
+
+int viterbi_rate_by_name(const char *name) {
+	for (int r = 0; r < VITERBI_RATES; r++)
+		if (!strcmp(viterbi_rates[r].name, name))
+			return r;
+	return -1;
+}
+
+const char *viterbi_rate_name(int rate) {
+	return viterbi_rates[rate].name;
+}
+
+static void viterbi_init_tables() {
+	/* generate tables */
+	for (int i = 0; i < VITERBI_STATES; i++) {
+		for (int inp = 0; inp < 2; inp++) {
+			xtab[i * 2 + inp] =
+				((i >> 0) & 1) ^
+				((i >> 3) & 1) ^
+				((i >> 4) & 1) ^
+				((i >> 5) & 1) ^
+				inp;
+			ytab[i * 2 + inp] =
+				((i >> 0) & 1) ^
+				((i >> 1) & 1) ^
+				((i >> 3) & 1) ^
+				((i >> 4) & 1) ^
+				inp;
+		}
+	}
+
+	for (int cmb = 0; cmb < 16; cmb++) {
+		int hasx = cmb >> 3, x = (cmb >> 2) & 1, hasy = (cmb >> 1) & 1, y = cmb & 1;
+		for (int g = 0; g < 4; g++)
+			for (int j = 0; j < VITERBI_HALF; j++) {
+				int i = 2 * j + (g & 1);
+				int inp = g >> 1;
+				bmtab[cmb][g][j] =
+					(hasx && x != xtab[i * 2 + inp]) +
+					(hasy && y != ytab[i * 2 + inp]);
+			}
+	}
+
+	for (int g = 0; g < 4; g++)
+		for (int j = 0; j < VITERBI_HALF; j++) {
+			int i = 2 * j + (g & 1);
+			int inp = g >> 1;
+			xsgn[g][j] = xtab[i * 2 + inp] ? 1 : -1;
+			ysgn[g][j] = ytab[i * 2 + inp] ? 1 : -1;
+		}
+
+	viterbi_init_rates();
+
+	/* The best kernel this CPU can run, unless told otherwise. */
+	for (int i = 0; viterbi_kernels[i].name; i++)
+		viterbi_use_kernel(viterbi_kernels[i].name);
+	if (getenv("VITERBI_ACS"))
+		viterbi_use_kernel(getenv("VITERBI_ACS"));
+}
+
+static void viterbi_init_once() {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, viterbi_init_tables);
+}
+
+/* Switch every decoder in the process over to another kernel; returns 0 if
+ * there's no such kernel, or this CPU can't run it.  Don't call it while
+ * something is decoding.  */
+int viterbi_select_kernel(const char *name) {
+	viterbi_init_once();
+	return viterbi_use_kernel(name);
+}
+
+/* Information bits per coded bit. */
+double viterbi_rate_value(int rate) {
+	viterbi_init_once();
+	return (double)viterbi_rates[rate].period / viterbi_rates[rate].nbits;
+}
+
+/* Encode nbits of data (packed, first bit in bit 7), starting at the
+ * beginning of a puncturing period, into one coded bit per byte.  Returns
+ * the number of coded bits.  */
+int viterbi_encode(int rate, const uint8_t *data, int nbits, uint8_t *coded) {
+	viterbi_init_once();
+
+	const viterbi_rate_t *r = &viterbi_rates[rate];
+	int ncoded = 0, st = 0;
+
+	for (int i = 0; i < nbits; i++) {
+		int inp = (data[i / 8] >> (7 - i % 8)) & 1;
+		int x = ((st >> 0) ^ (st >> 3) ^ (st >> 4) ^ (st >> 5) ^ inp) & 1;
+		int y = ((st >> 0) ^ (st >> 1) ^ (st >> 3) ^ (st >> 4) ^ inp) & 1;
+
+		if (r->xsrc[i % r->period] >= 0)
+			coded[ncoded++] = x;
+		if (r->ysrc[i % r->period] >= 0)
+			coded[ncoded++] = y;
+		st = (st >> 1) | (inp << VITERBI_K);
+	}
+
+	return ncoded;
+}
+
+/* Start a decoder from scratch, with every state equally likely. */
+static void viterbi_reset(viterbi_state_t *v, int depth, viterbi_output_t output, void *priv) {
+	memset(v, 0, sizeof(*v));
+	v->strenorm = VITERBI_RENORM;
+	v->depth = depth;
+	v->output = output;
+	v->priv = priv;
+}
+
+static int64_t viterbi_consume(viterbi_state_t *v, int final);
+
+static void viterbi_renorm(viterbi_state_t *v) {
+	int16_t *pm = v->pmbuf[v->pmcur];
+	int16_t min = pm[0];
+	for (int i = 1; i < VITERBI_STATES; i++)
+		if (pm[i] < min)
+			min = pm[i];
+	for (int i = 0; i < VITERBI_STATES; i++)
+		pm[i] -= min;
+	v->pm_offset += min;
+}
+
+/* The metric of the best path so far, renormalization included. */
+static int64_t viterbi_best_metric(viterbi_state_t *v) {
+	int16_t min = v->pmbuf[v->pmcur][0];
+	for (int i = 1; i < VITERBI_STATES; i++)
+		if (v->pmbuf[v->pmcur][i] < min)
+			min = v->pmbuf[v->pmcur][i];
+	return v->pm_offset + min;
+}
+
+static int viterbi_best_state(viterbi_state_t *v) {
+	int st = 0;
+	for (int i = 1; i < VITERBI_STATES; i++)
+		if (v->pmbuf[v->pmcur][i] < v->pmbuf[v->pmcur][st])
+			st = i;
+	return st;
+}
+
+/* nbits more bits have been decided, as of now. */
+static void viterbi_account(viterbi_state_t *v, int nbits) {
+	if (nbits <= 0)
+		return;
+	/* bit g went in at step g, so has waited steps - 1 - g */
+	int64_t first = v->steps - 1 - v->nout;
+	v->lat_sum += first * nbits - (int64_t)nbits * (nbits - 1) / 2;
+	if (first > v->lat_max)
+		v->lat_max = first;
+	v->nout += nbits;
+}
+
+/* Release the next byte, from the best state's register. */
+static void viterbi_rx_byte(viterbi_state_t *v) {
+	uint8_t byte = v->rxreg[v->rxcur][viterbi_best_state(v)] >> (v->steps - v->nout - 8);
+
+	viterbi_account(v, 8);
+	if (v->output)
+		v->output(v->priv, &byte, 1);
+}
+
+static void viterbi_rx_step(viterbi_state_t *v, uint64_t dec) {
+	viterbi_rx(v->rxreg[v->rxcur], v->rxreg[v->rxcur ^ 1], dec);
+	v->rxcur ^= 1;
+
+	/* Only look for the best state once there's a whole byte whose
+	 * newest bit is old enough.  */
+	if (v->steps - v->nout >= v->rx_depth + 8)
+		viterbi_rx_byte(v);
+}
+
+static inline __attribute__((always_inline)) void viterbi_step(viterbi_state_t *v, const int16_t (*bm)[VITERBI_HALF]) {
+	uint64_t dec = viterbi_acs(v->pmbuf[v->pmcur], v->pmbuf[v->pmcur ^ 1], bm);
+	v->pmcur ^= 1;
+	v->steps++;
+
+	if (--v->strenorm == 0) {
+		viterbi_renorm(v);
+		v->strenorm = VITERBI_RENORM;
+	}
+
+	if (v->rx_depth) {
+		viterbi_rx_step(v, dec);
+		return;
+	}
+
+	v->decbuf[v->sttail] = dec;
+	v->sttail = (v->sttail + 1) % VITERBI_BUFSZ;
+	if (v->sttail == (v->sthead + v->depth + OUTPUT_BITS) % VITERBI_BUFSZ) {
+		(void) viterbi_consume(v, 0);
+	}
+}
+
+/* Hard decisions: the branch metric is the Hamming distance.  Each step
+ * is given as a VITERBI_CMB() index.  */
+static void viterbi_hard(viterbi_state_t *v, const uint8_t *cmb, int nsteps) {
+	for (int i = 0; i < nsteps; i++)
+		viterbi_step(v, bmtab[cmb[i]]);
+}
+
+/* Soft decisions: LLRs are positive when 0 is more likely, and 0 for an
+ * erasure (a punctured bit).  Each bit costs 128 + llr if the branch
+ * expects a 1, or 128 - llr if it expects a 0, so a hard bit is just an
+ * LLR of +/-127.  */
+static void viterbi_soft(viterbi_state_t *v, const int8_t *llrs, int nsteps) {
+	int16_t bm[4][VITERBI_HALF] __attribute__((aligned(32)));
+	int16_t *bmp = &bm[0][0];
+	const int16_t *xs = &xsgn[0][0], *ys = &ysgn[0][0];
+
+	for (int n = 0; n < nsteps; n++) {
+		int lx = llrs[2 * n], ly = llrs[2 * n + 1];
+
+		if (lx == -128)
+			lx = -127;
+		if (ly == -128)
+			ly = -127;
+		for (int i = 0; i < 4 * VITERBI_HALF; i++)
+			bmp[i] = 256 + xs[i] * lx + ys[i] * ly;
+		viterbi_step(v, bm);
+	}
+}
+
+/* Depuncture whole periods of hard bits, one per byte, into one VITERBI_CMB()
+ * per trellis step.  Returns the number of steps.  */
+static int viterbi_depuncture(const viterbi_rate_t *r, const uint8_t *bits, int nbits, uint8_t *cmb) {
+	int n = 0;
+
+	for (int pos = 0; pos + r->nbits <= nbits; pos += r->nbits)
+		for (int i = 0; i < r->period; i++, n++) {
+			int hasx = r->xsrc[i] >= 0, hasy = r->ysrc[i] >= 0;
+			cmb[n] = VITERBI_CMB(hasx, hasx ? bits[pos + r->xsrc[i]] : 0,
+			                     hasy, hasy ? bits[pos + r->ysrc[i]] : 0);
+		}
+
+	return n;
+}
+
+/* Likewise for LLRs, into (X, Y) pairs with erasures where punctured. */
+static int viterbi_depuncture_soft(const viterbi_rate_t *r, const int8_t *llrs, int nbits, int8_t *pairs) {
+	int n = 0;
+
+	for (int pos = 0; pos + r->nbits <= nbits; pos += r->nbits)
+		for (int i = 0; i < r->period; i++, n++) {
+			pairs[2 * n]     = r->xsrc[i] >= 0 ? llrs[pos + r->xsrc[i]] : 0;
+			pairs[2 * n + 1] = r->ysrc[i] >= 0 ? llrs[pos + r->ysrc[i]] : 0;
+		}
+
+	return n;
+}
+
+/* Do a backwards pass, spitting out the first OUTPUT_BITS (or all of the
+ * bits, if final).  */
+static int64_t viterbi_consume(viterbi_state_t *v, int final) {
+	if (v->rx_depth) {
+		/* Only ever called to finish up: everything left is final now. */
+		while (v->steps - v->nout >= 8)
+			viterbi_rx_byte(v);
+		return viterbi_best_metric(v);
+	}
+
+	uint8_t outbuf[VITERBI_BUFSZ / 8] = {};
+	int outpos = (v->sttail + VITERBI_BUFSZ - v->sthead - 1) % VITERBI_BUFSZ;
+	int totbytes = (outpos + 1) / 8;
+
+	int vptr = (v->sttail + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ;
+
+	/* Find the initial state with the best (most likely) path metric. */
+	int st = 0;
+	int pm = v->pmbuf[v->pmcur][st];
+	for (int i = 0; i < VITERBI_STATES; i++)
+		if (v->pmbuf[v->pmcur][i] < v->pmbuf[v->pmcur][st]) {
+			st = i;
+			pm = v->pmbuf[v->pmcur][i];
+		}
+
+	/* Now do the reverse pass. */
+	while (vptr != (v->sthead + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ) {
+		outbuf[outpos / 8] |= (st >> VITERBI_K) << (7 - outpos % 8);
+		st = ((st << 1) & (VITERBI_STATES - 1)) | ((v->decbuf[vptr] >> st) & 1);
+		vptr = (vptr + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ;
+		outpos--;
+	}
+
+	v->sthead = (v->sthead + OUTPUT_BITS) % VITERBI_BUFSZ;
+	viterbi_account(v, final ? totbytes * 8 : OUTPUT_BITS);
+	if (v->output)
+		v->output(v->priv, outbuf, final ? totbytes : OUTPUT_BITS / 8);
+
+	return pm + v->pm_offset;
+}
+
+/* Puncture phase synchronization.  Nothing tells us where in the puncturing
+ * period the input starts, so we decode a short window once from each
+ * possible starting offset, and pick the offset whose best path metric grew
+ * the least.  Once locked, every so often we try all the offsets again on
+ * the next window (or right away, if the growth suddenly jumps), and if
+ * another offset keeps doing better than the one we're using, the input
+ * must have slipped, so we move over to it.
+ *
+ * Growth is normalized so that 0 means every coded bit agreed with the best
+ * path and 1 means none did: for hard bits, that's just the fraction of
+ * bits corrected; for LLRs, it's the fraction of the total |LLR| that the
+ * best path had to go against.  The higher rates can fit nearly anything
+ * (a wrong offset at 7/8 only grows by about 0.02 on clean input), so we
+ * only ever compare offsets against each other, never against a fixed
+ * threshold.  */
+#define VITERBI_SYNC_STEPS 1024 /* trellis steps per window */
+#define VITERBI_SYNC_OVERHEAD 8 /* recheck about 1 / this of the windows' worth of work */
+#define VITERBI_SYNC_BAD 2 /* rechecks in a row that prefer another offset before we move */
+#define VITERBI_SYNC_JUMP 0.005 /* growth over twice the average, plus this, is suspicious */
+
+#define VITERBI_LOG(s, ...) do { if ((s)->log) fprintf((s)->log, __VA_ARGS__); } while (0)
+
+/* Returns 0, or -1 if there's no such rate or no memory for the buffers. */
+int viterbi_init(viterbi_t *s, int rate, int soft, viterbi_output_t output, void *priv) {
+	viterbi_init_once();
+
+	memset(s, 0, sizeof(*s));
+	if (rate < 0 || rate >= VITERBI_RATES)
+		return -1;
+
+	const viterbi_rate_t *r = &viterbi_rates[rate];
+	int periods = (VITERBI_SYNC_STEPS + r->period - 1) / r->period;
+
+	s->rate = r;
+	s->soft = soft;
+	s->window = periods * r->nbits;
+	s->recheck = VITERBI_SYNC_OVERHEAD * r->nbits;
+	s->fixed = -1;
+	viterbi_reset(&s->dec, r->depth, output, priv);
+	s->buf = malloc(s->window * 2 + r->nbits);
+	s->cmb = malloc(periods * r->period);
+	s->pairs = malloc(periods * r->period * 2);
+	if (!s->buf || !s->cmb || !s->pairs) {
+		viterbi_free(s);
+		return -1;
+	}
+	return 0;
+}
+
+void viterbi_free(viterbi_t *s) {
+	free(s->buf);
+	free(s->cmb);
+	free(s->pairs);
+	s->buf = NULL;
+	s->cmb = NULL;
+	s->pairs = NULL;
+}
+
+/* If something else already knows where the periods start (say, because
+ * it's the encoder), skip the search: the input starts offset coded bits
+ * before the start of a period.  */
+void viterbi_set_offset(viterbi_t *s, int offset) {
+	s->fixed = offset;
+}
+
+/* Switch to register exchange, releasing each byte as soon as its last bit
+ * is depth steps old (1 - 56), or back to traceback with 0.  Takes effect
+ * from the next lock.  */
+void viterbi_set_latency(viterbi_t *s, int depth) {
+	s->rx_depth = depth;
+	if (!s->locked)
+		s->dec.rx_depth = depth;
+}
+
+/* Decode (up to) a window starting at in, returning the normalized growth. */
+static double viterbi_sync_window(viterbi_t *s, viterbi_state_t *v, const int8_t *in, int n) {
+	int64_t pm0 = viterbi_best_metric(v);
+	double base, scale;
+
+	if (s->soft) {
+		int nsteps = viterbi_depuncture_soft(s->rate, in, n, s->pairs);
+		int64_t sum = 0;
+
+		for (int i = 0; i < nsteps * 2; i++)
+			sum += s->pairs[i] == -128 ? 127 : abs(s->pairs[i]);
+		viterbi_soft(v, s->pairs, nsteps);
+		base = 256.0 * nsteps - sum;
+		scale = 2.0 * sum;
+	} else {
+		viterbi_hard(v, s->cmb, viterbi_depuncture(s->rate, (const uint8_t *)in, n, s->cmb));
+		base = 0.0;
+		scale = n / s->rate->nbits * s->rate->nbits;
+	}
+
+	if (scale == 0.0)
+		return 1.0;
+	return (viterbi_best_metric(v) - pm0 - base) / scale;
+}
+
+static void viterbi_sync_drop(viterbi_t *s, int n) {
+	s->nbuf -= n;
+	memmove(s->buf, s->buf + n, s->nbuf);
+}
+
+/* Try each offset, from scratch, over the first n coded bits in the buffer
+ * (which needs a period's worth extra), and return the best one.  */
+static int viterbi_sync_best(viterbi_t *s, int n) {
+	int best = 0;
+	double bestg = 2.0;
+
+	for (int ofs = 0; ofs < s->rate->nbits; ofs++) {
+		viterbi_reset(&s->cand, s->rate->depth, NULL, NULL);
+		double g = viterbi_sync_window(s, &s->cand, s->buf + ofs, n);
+		if (g < bestg) {
+			best = ofs;
+			bestg = g;
+		}
+	}
+
+	return best;
+}
+
+static void viterbi_sync_lock(viterbi_t *s, int ofs, int n) {
+	if (s->fixed < 0)
+		VITERBI_LOG(s, "viterbi: locked at offset %d of %d\n", ofs, s->rate->nbits);
+	s->locked = 1;
+	s->offset = ofs;
+	s->windows = 0;
+	s->bad = 0;
+	s->suspect = 0;
+	s->syncs++;
+	viterbi_reset(&s->dec, s->rate->depth, s->dec.output, s->dec.priv);
+	s->dec.rx_depth = s->rx_depth;
+	s->growth = s->avg = viterbi_sync_window(s, &s->dec, s->buf + ofs, n);
+	viterbi_sync_drop(s, ofs + n);
+}
+
+static void viterbi_sync_run(viterbi_t *s) {
+	while (s->nbuf >= s->window + s->rate->nbits) {
+		if (!s->locked) {
+			viterbi_sync_lock(s, s->fixed >= 0 ? s->fixed : viterbi_sync_best(s, s->window), s->window);
+			continue;
+		}
+
+		if (s->fixed < 0 && (++s->windows % s->recheck == 0 || s->suspect)) {
+			int ofs = viterbi_sync_best(s, s->window);
+			s->suspect = 0;
+			if (ofs == 0) {
+				s->bad = 0;
+			} else if (++s->bad < VITERBI_SYNC_BAD) {
+				s->suspect = 1;
+			} else {
+				VITERBI_LOG(s, "viterbi: slipped by %d\n", ofs);
+				(void) viterbi_consume(&s->dec, 1);
+				s->slips++;
+				viterbi_sync_lock(s, ofs, s->window);
+				continue;
+			}
+		}
+
+		s->growth = viterbi_sync_window(s, &s->dec, s->buf, s->window);
+		viterbi_sync_drop(s, s->window);
+		if (s->growth > 2.0 * s->avg + VITERBI_SYNC_JUMP)
+			s->suspect = 1;
+		else
+			s->avg += (s->growth - s->avg) / 8.0;
+	}
+}
+
+static void viterbi_push(viterbi_t *s, const int8_t *in, int n) {
+	while (n > 0) {
+		int take = s->window * 2 + s->rate->nbits - s->nbuf;
+		if (take > n)
+			take = n;
+		memcpy(s->buf + s->nbuf, in, take);
+		s->nbuf += take;
+		in += take;
+		n -= take;
+		viterbi_sync_run(s);
+	}
+}
+
+/* LLRs are positive when 0 is more likely, one per coded bit. */
+void viterbi_push_llrs(viterbi_t *s, const int8_t *in, int n) {
+	viterbi_push(s, in, n);
+}
+
+/* Hard bits are packed, first bit in bit 7. */
+void viterbi_push_bits(viterbi_t *s, const uint8_t *in, int nbytes) {
+	int8_t bits[8 * 512];
+
+	while (nbytes > 0) {
+		int n = nbytes < 512 ? nbytes : 512;
+		for (int i = 0; i < n * 8; i++)
+			bits[i] = (in[i / 8] >> (7 - i % 8)) & 1;
+		viterbi_push(s, bits, n * 8);
+		in += n;
+		nbytes -= n;
+	}
+}
+
+/* Decode whatever is left over, and return the final path metric. */
+int64_t viterbi_flush(viterbi_t *s) {
+	if (!s->locked && s->fixed >= 0 && s->nbuf > s->fixed)
+		viterbi_sync_lock(s, s->fixed, s->nbuf - s->fixed);
+	else if (!s->locked && s->nbuf > s->rate->nbits)
+		viterbi_sync_lock(s, viterbi_sync_best(s, s->nbuf - s->rate->nbits), s->nbuf - s->rate->nbits);
+	if (s->locked && s->nbuf >= s->rate->nbits)
+		s->growth = viterbi_sync_window(s, &s->dec, s->buf, s->nbuf);
+	s->nbuf = 0;
+	return viterbi_consume(&s->dec, 1);
+}
+
+
+/* Block-parallel decoding, for when the whole coded stream is already on
+ * hand.  The stream is cut into blocks, and each block is decoded on its
+ * own, starting from scratch a little before the block (so that the
+ * metrics have settled by the time it starts) and running a little past it
+ * (so that its last bits get a full traceback).  The warm-up is a whole
+ * number of OUTPUT_BITS, so each block's decoder makes its decisions at the
+ * same points in the stream that a single sequential decoder would; once
+ * the survivors have merged, which they almost always have long before the
+ * warm-up is over, the output is identical.
+ *
+ * Slips aren't tracked: the puncture phase is found once, at the start.  */
+#define VITERBI_PAR_BLOCK 65536 /* trellis steps per block, roughly */
+#define VITERBI_PAR_CHUNK 1024 /* periods depunctured at a time */
+
+typedef struct {
+	const viterbi_rate_t *rate;
+	int soft;
+	const uint8_t *in; /* packed bits, or LLRs */
+	int64_t base; /* first coded bit, after the puncture phase */
+	int64_t nsteps;
+	int64_t block; /* steps per block */
+	int64_t warmup; /* steps decoded before each block */
+	int64_t tail; /* steps decoded after each block */
+	int nblocks;
+	uint8_t *out; /* decoded bytes, at step / 8 */
+	int64_t outlen; /* valid bytes, once the last block is done */
+	int next; /* next block to hand out */
+	int failed; /* a worker ran out of memory */
+	pthread_mutex_t lock;
+} viterbi_par_t;
+
+typedef struct {
+	uint8_t *buf;
+	int64_t len;
+} viterbi_par_out_t;
+
+static void viterbi_par_collect(void *priv, const uint8_t *buf, int len) {
+	viterbi_par_out_t *o = priv;
+	memcpy(o->buf + o->len, buf, len);
+	o->len += len;
+}
+
+static void viterbi_par_block(viterbi_par_t *p, int k, int8_t *in, uint8_t *cmb, int8_t *pairs, viterbi_state_t *v) {
+	const viterbi_rate_t *r = p->rate;
+	int64_t s0 = k * p->block;
+	int64_t a = k ? s0 - p->warmup : 0;
+	int64_t e = s0 + p->block < p->nsteps ? s0 + p->block : p->nsteps;
+	int64_t b = (k == p->nblocks - 1 || e + p->tail > p->nsteps) ? p->nsteps : e + p->tail;
+	viterbi_par_out_t o;
+
+	o.buf = malloc((b - a) / 8 + VITERBI_BUFSZ / 8);
+	o.len = 0;
+	if (!o.buf) {
+		__atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	viterbi_reset(v, r->depth, viterbi_par_collect, &o);
+
+	for (int64_t per = a / r->period; per < b / r->period; per += VITERBI_PAR_CHUNK) {
+		int n = b / r->period - per < VITERBI_PAR_CHUNK ? b / r->period - per : VITERBI_PAR_CHUNK;
+		int64_t c0 = p->base + per * r->nbits;
+
+		if (p->soft) {
+			memcpy(in, p->in + c0, n * r->nbits);
+			viterbi_soft(v, pairs, viterbi_depuncture_soft(r, in, n * r->nbits, pairs));
+		} else {
+			for (int i = 0; i < n * r->nbits; i++)
+				in[i] = (p->in[(c0 + i) / 8] >> (7 - (c0 + i) % 8)) & 1;
+			viterbi_hard(v, cmb, viterbi_depuncture(r, (const uint8_t *)in, n * r->nbits, cmb));
+		}
+	}
+	(void) viterbi_consume(v, 1);
+
+	/* Keep just the block itself; the last block keeps whatever the
+	 * final traceback gave it.  */
+	int64_t skip = (s0 - a) / 8;
+	int64_t len = (k == p->nblocks - 1) ? o.len - skip : (e - s0) / 8;
+	if (len > o.len - skip)
+		len = o.len - skip;
+	if (len > 0)
+		memcpy(p->out + s0 / 8, o.buf + skip, len);
+	if (k == p->nblocks - 1)
+		p->outlen = s0 / 8 + (len > 0 ? len : 0);
+	free(o.buf);
+}
+
+static void *viterbi_par_worker(void *arg) {
+	viterbi_par_t *p = arg;
+	int8_t *in = malloc(VITERBI_PAR_CHUNK * p->rate->nbits);
+	uint8_t *cmb = malloc(VITERBI_PAR_CHUNK * p->rate->period);
+	int8_t *pairs = malloc(VITERBI_PAR_CHUNK * p->rate->period * 2);
+	viterbi_state_t *v = malloc(sizeof(*v));
+
+	if (!in || !cmb || !pairs || !v)
+		__atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+	while (!__atomic_load_n(&p->failed, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&p->lock);
+		int k = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		if (k >= p->nblocks)
+			break;
+		viterbi_par_block(p, k, in, cmb, pairs, v);
+	}
+
+	free(in);
+	free(cmb);
+	free(pairs);
+	free(v);
+	return NULL;
+}
+
+/* Decode n coded bits (packed hard bits, first bit in bit 7, or one LLR per
+ * byte) on nthreads threads, and hand the output over in one piece.  The
+ * puncturing period starts at coded bit offset, or -1 to find it.  Returns
+ * the number of bytes decoded, or -1 if there's no such rate or not enough
+ * memory.  */
+int64_t viterbi_decode_parallel(int rate, int soft, const uint8_t *in, int64_t n, int offset,
+                                int nthreads, viterbi_output_t output, void *priv) {
+	const viterbi_rate_t *r;
+	viterbi_par_t p;
+	viterbi_t sync;
+
+	viterbi_init_once();
+	if (rate < 0 || rate >= VITERBI_RATES)
+		return -1;
+	r = &viterbi_rates[rate];
+
+	/* Find the puncture phase the same way the sequential decoder would:
+	 * from the first window.  */
+	if (offset < 0) {
+		if (viterbi_init(&sync, rate, soft, NULL, NULL) < 0)
+			return -1;
+		int64_t nsync = sync.window + r->nbits < n ? sync.window + r->nbits : n;
+		if (soft)
+			viterbi_push_llrs(&sync, (const int8_t *)in, nsync);
+		else
+			viterbi_push_bits(&sync, in, (nsync + 7) / 8);
+		if (!sync.locked)
+			(void) viterbi_flush(&sync);
+		viterbi_free(&sync);
+		offset = sync.offset;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.rate = r;
+	p.soft = soft;
+	p.in = in;
+	p.base = offset;
+	p.nsteps = (n - p.base) / r->nbits * r->period;
+	if (p.nsteps <= 0)
+		return 0;
+
+	/* Blocks (and the warm-up) start on both a period and an OUTPUT_BITS
+	 * boundary.  */
+	int64_t unit = OUTPUT_BITS;
+	while (unit % r->period)
+		unit += OUTPUT_BITS;
+	p.warmup = unit;
+	p.block = (VITERBI_PAR_BLOCK + unit - 1) / unit * unit;
+	p.tail = (r->depth + r->period) / r->period * r->period;
+	p.nblocks = (p.nsteps + p.block - 1) / p.block;
+	if (nthreads > p.nblocks)
+		nthreads = p.nblocks;
+	p.out = malloc(p.nsteps / 8 + 1);
+	pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+	if (!p.out || !threads) {
+		free(p.out);
+		free(threads);
+		return -1;
+	}
+	pthread_mutex_init(&p.lock, NULL);
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, viterbi_par_worker, &p);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&p.lock);
+
+	if (p.failed) {
+		free(p.out);
+		return -1;
+	}
+	if (output && p.outlen > 0)
+		output(priv, p.out, p.outlen);
+	free(p.out);
+	return p.outlen;
+}
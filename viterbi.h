@@ -0,0 +1,118 @@
+#ifndef VITERBI_H
+#define VITERBI_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Inner decoder for DVB-T: the K=7, rate 1/2 convolutional code (G1 = 171,
+ * G2 = 133 octal) of section 4.3.3, punctured to any of the code rates that
+ * TPS can signal.  Each viterbi_t is a complete, independent decoder, so
+ * there can be as many of them running at once as there are muxes (or
+ * threads); the tables that they share are built once, and never change
+ * after that.
+ *
+ * Input is pushed in as it arrives -- either packed hard bits, or one int8
+ * LLR per coded bit -- and decoded bytes come back out through a callback.
+ * The decoder works out the puncturing phase itself, and keeps track of it
+ * if the input slips.  */
+
+#define VITERBI_MAX_DEPTH 128 /* traceback, in trellis steps; each rate has its own */
+#define OUTPUT_BITS 256
+#define VITERBI_BUFSZ (VITERBI_MAX_DEPTH + OUTPUT_BITS + 8)
+/* n.b.: VITERBI_BUFSZ should be a multiple of 8 */
+
+#define VITERBI_K 5
+#define VITERBI_STATES (1 << (VITERBI_K + 1))
+#define VITERBI_HALF (VITERBI_STATES / 2)
+
+/* Code rates, numbered as in the TPS. */
+#define VITERBI_RATE_1_2 0
+#define VITERBI_RATE_2_3 1
+#define VITERBI_RATE_3_4 2
+#define VITERBI_RATE_5_6 3
+#define VITERBI_RATE_7_8 4
+#define VITERBI_RATES 5
+
+typedef void (*viterbi_output_t)(void *priv, const uint8_t *buf, int len);
+
+/* Each new state n has two predecessors, 2(n % 32) ("even") and
+ * 2(n % 32) + 1 ("odd"), and its input bit is n / 32.  The traceback only
+ * needs to know which of the two won, so each step keeps one word with bit
+ * n set if state n came from the odd predecessor; only the current and the
+ * next set of path metrics are ever live.  */
+typedef struct viterbi_state {
+	int16_t pmbuf[2][VITERBI_STATES];
+	int pmcur; /* which of pmbuf holds the latest metrics */
+	uint64_t decbuf[VITERBI_BUFSZ];
+	int sthead; /* position of the first path element that hasn't yet been consumed */
+	int sttail; /* position of the next path to be written */
+	int strenorm; /* steps until the next renormalization */
+	int64_t pm_offset; /* total subtracted out of the path metrics */
+	int depth; /* steps traced back before any are decided */
+
+	/* Register exchange, for low latency: rather than tracing back
+	 * through decbuf, every state carries its survivor's last inputs
+	 * along with it (newest in bit 0), and a byte is final once its
+	 * newest bit is rx_depth steps old.  0 to trace back instead.  */
+	int rx_depth;
+	uint64_t rxreg[2][VITERBI_STATES];
+	int rxcur;
+
+	/* Latency, in trellis steps between a bit going in and coming back
+	 * out, per bit.  */
+	int64_t steps; /* taken so far */
+	int64_t nout; /* bits decided so far */
+	int64_t lat_sum;
+	int64_t lat_max;
+
+	/* Where decoded bytes go, or NULL to throw them away. */
+	viterbi_output_t output;
+	void *priv;
+} viterbi_state_t;
+
+typedef struct viterbi {
+	const struct viterbi_rate *rate;
+	int soft;
+	int window; /* coded bits per sync window, a whole number of periods */
+	int recheck; /* windows between rechecks */
+	int fixed; /* offset given by viterbi_set_offset; don't search */
+	viterbi_state_t dec; /* the decoder whose output we keep */
+	viterbi_state_t cand; /* scratch decoder for trying out offsets */
+	int locked;
+	int windows; /* decoded since we locked */
+	int bad; /* rechecks in a row that preferred another offset */
+	int suspect; /* recheck the next window */
+	double avg; /* average growth while locked */
+	int offset; /* that we locked at */
+	int rx_depth; /* for dec; see viterbi_state_t */
+
+	int8_t *buf; /* coded bits (one per byte) or LLRs not yet decoded */
+	int nbuf;
+	uint8_t *cmb; /* one window, depunctured */
+	int8_t *pairs;
+
+	/* Statistics */
+	double growth; /* normalized path metric growth over the last window */
+	int syncs; /* times we've locked */
+	int slips; /* times we've moved to another offset */
+	FILE *log; /* lock and slip news, if anyone wants it; NULL by default */
+} viterbi_t;
+
+/* viterbi.c */
+extern const char *viterbi_kernel_name(int i);
+extern int viterbi_select_kernel(const char *name);
+extern int viterbi_rate_by_name(const char *name);
+extern const char *viterbi_rate_name(int rate);
+extern double viterbi_rate_value(int rate);
+extern int viterbi_encode(int rate, const uint8_t *data, int nbits, uint8_t *coded);
+extern int viterbi_init(viterbi_t *v, int rate, int soft, viterbi_output_t output, void *priv);
+extern void viterbi_set_offset(viterbi_t *v, int offset);
+extern void viterbi_set_latency(viterbi_t *v, int depth);
+extern void viterbi_push_bits(viterbi_t *v, const uint8_t *in, int nbytes);
+extern void viterbi_push_llrs(viterbi_t *v, const int8_t *in, int n);
+extern int64_t viterbi_flush(viterbi_t *v);
+extern void viterbi_free(viterbi_t *v);
+extern int64_t viterbi_decode_parallel(int rate, int soft, const uint8_t *in, int64_t n, int offset,
+                                       int nthreads, viterbi_output_t output, void *priv);
+
+#endif
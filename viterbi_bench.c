@@ -0,0 +1,324 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "viterbi.h"
+
+/* Benchmark for the inner decoder: random data through an encoder and
+ * puncturer of our own, BPSK over a seeded AWGN channel, then back through
+ * every decoder variant -- each kernel, hard and soft input, traceback and
+ * register exchange, sequential and parallel.  For each one it reports the
+ * throughput and the bit and block error rates, and it checks that they
+ * all give exactly the same output as the plain C decoder when the channel
+ * is clean enough for that to be the data.  */
+
+#define BENCH_BITS (1 << 20)
+#define BENCH_ROUND (8 * 2 * 3 * 5 * 7) /* bits: whole puncturing periods, and whole bytes coded, at every rate */
+#define BENCH_BLOCK 188 /* bytes; one TS packet */
+#define BENCH_DEPTH 40 /* for register exchange */
+#define BENCH_THREADS 4
+#define BENCH_CLEAN 12.0 /* Eb/N0 for the bit-exactness check, dB */
+
+static const double bench_ebn0[] = { 3.0, 4.0, 5.0 };
+#define BENCH_POINTS (int)(sizeof(bench_ebn0) / sizeof(bench_ebn0[0]))
+
+/* Section 4.3.3, written out independently of viterbi.c so that the two
+ * check each other.  */
+static const struct {
+	const char *x, *y;
+} bench_punct[VITERBI_RATES] = {
+	{ "1",       "1" },
+	{ "10",      "11" },
+	{ "101",     "110" },
+	{ "10101",   "11010" },
+	{ "1000101", "1111010" },
+};
+
+#define BENCH_G1 0171
+#define BENCH_G2 0133
+
+/* Returns the number of coded bits, one per byte. */
+int bench_encode(int rate, const uint8_t *data, int nbits, uint8_t *coded) {
+	const char *x = bench_punct[rate].x, *y = bench_punct[rate].y;
+	int period = strlen(x);
+	int sr = 0, n = 0;
+
+	for (int i = 0; i < nbits; i++) {
+		/* Newest bit at the top, as in figure 6 of the standard. */
+		sr = (sr >> 1) | (((data[i / 8] >> (7 - i % 8)) & 1) << 6);
+		if (x[i % period] == '1')
+			coded[n++] = __builtin_parity(sr & BENCH_G1);
+		if (y[i % period] == '1')
+			coded[n++] = __builtin_parity(sr & BENCH_G2);
+	}
+	return n;
+}
+
+uint64_t bench_rng;
+
+double bench_uniform() {
+	bench_rng ^= bench_rng << 13;
+	bench_rng ^= bench_rng >> 7;
+	bench_rng ^= bench_rng << 17;
+	return ((bench_rng >> 11) + 0.5) / 9007199254740992.0;
+}
+
+double bench_gauss() {
+	return sqrt(-2.0 * log(bench_uniform())) * cos(2.0 * M_PI * bench_uniform());
+}
+
+/* What goes into the decoder: both the hard slicer's output, packed, and
+ * LLRs, from the same noise.  */
+typedef struct bench_channel {
+	uint8_t *bits;
+	int8_t *llrs;
+	int n;
+} bench_channel_t;
+
+void bench_transmit(bench_channel_t *ch, const uint8_t *coded, int n, double sigma) {
+	memset(ch->bits, 0, n / 8 + 1);
+	for (int i = 0; i < n; i++) {
+		double rx = (coded[i] ? -1.0 : 1.0) + sigma * bench_gauss();
+
+		ch->bits[i / 8] |= (rx < 0) << (7 - i % 8);
+		ch->llrs[i] = fmax(fmin(rint(rx * 32.0), 127.0), -127.0);
+	}
+	ch->n = n;
+}
+
+typedef struct bench_variant {
+	const char *name;
+	int soft;
+	int depth; /* register exchange, or 0 */
+	int threads; /* parallel, or 0 */
+} bench_variant_t;
+
+static const bench_variant_t bench_variants[] = {
+	{ "hard",        0, 0,           0 },
+	{ "soft",        1, 0,           0 },
+	{ "hard rx",     0, BENCH_DEPTH, 0 },
+	{ "soft rx",     1, BENCH_DEPTH, 0 },
+	{ "hard par",    0, 0,           BENCH_THREADS },
+	{ "soft par",    1, 0,           BENCH_THREADS },
+	{ NULL },
+};
+
+typedef struct bench_out {
+	uint8_t *buf;
+	int len;
+	int size;
+} bench_out_t;
+
+void bench_collect(void *priv, const uint8_t *buf, int len) {
+	bench_out_t *o = priv;
+
+	if (len > o->size - o->len)
+		len = o->size - o->len;
+	memcpy(o->buf + o->len, buf, len);
+	o->len += len;
+}
+
+double bench_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Decode what came out of the channel with one variant; returns the time it
+ * took, in seconds.  */
+double bench_decode(int rate, const bench_variant_t *var, const bench_channel_t *ch, bench_out_t *o) {
+	double t0 = bench_now();
+
+	o->len = 0;
+	if (var->threads) {
+		if (viterbi_decode_parallel(rate, var->soft, var->soft ? (const uint8_t *)ch->llrs : ch->bits,
+		                            var->soft ? ch->n : ch->n / 8 * 8, 0, var->threads,
+		                            bench_collect, o) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	} else {
+		viterbi_t v;
+
+		if (viterbi_init(&v, rate, var->soft, bench_collect, o) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		viterbi_set_offset(&v, 0);
+		if (var->depth)
+			viterbi_set_latency(&v, var->depth);
+		if (var->soft)
+			viterbi_push_llrs(&v, ch->llrs, ch->n);
+		else
+			viterbi_push_bits(&v, ch->bits, ch->n / 8);
+		(void) viterbi_flush(&v);
+		viterbi_free(&v);
+	}
+	return bench_now() - t0;
+}
+
+/* Bit errors, and whole blocks with any errors in them, over the blocks
+ * that were decoded.  */
+typedef struct bench_errors {
+	int64_t bits, errs;
+	int64_t blocks, blkerrs;
+} bench_errors_t;
+
+void bench_count(bench_errors_t *e, const bench_out_t *o, const uint8_t *data) {
+	int nblocks = o->len / BENCH_BLOCK;
+
+	memset(e, 0, sizeof(*e));
+	for (int b = 0; b < nblocks; b++) {
+		int n = 0;
+
+		for (int i = b * BENCH_BLOCK; i < (b + 1) * BENCH_BLOCK; i++)
+			n += __builtin_popcount(o->buf[i] ^ data[i]);
+		e->errs += n;
+		e->blkerrs += n != 0;
+	}
+	e->bits = (int64_t)nblocks * BENCH_BLOCK * 8;
+	e->blocks = nblocks;
+}
+
+double bench_sigma(int rate, double ebn0) {
+	return sqrt(1.0 / (2.0 * viterbi_rate_value(rate) * pow(10.0, ebn0 / 10.0)));
+}
+
+/* Returns the number of variants that didn't match the reference. */
+int bench_rate(int rate, int nbits) {
+	uint8_t *data = malloc(nbits / 8);
+	uint8_t *coded = malloc(nbits * 2);
+	uint8_t *check = malloc(nbits * 2);
+	bench_channel_t ch[1 + BENCH_POINTS]; /* the clean one first */
+	bench_out_t ref, o;
+	int ncoded, failed = 0;
+
+	for (int i = 0; i < nbits / 8; i++)
+		data[i] = bench_uniform() * 256.0;
+	ncoded = bench_encode(rate, data, nbits, coded);
+	if (viterbi_encode(rate, data, nbits, check) != ncoded || memcmp(coded, check, ncoded)) {
+		printf("Code rate %s: viterbi_encode disagrees with the reference encoder\n",
+		       viterbi_rate_name(rate));
+		failed++;
+	}
+
+	/* Every variant sees the same noise. */
+	for (int p = 0; p <= BENCH_POINTS; p++) {
+		ch[p].bits = malloc(ncoded / 8 + 1);
+		ch[p].llrs = malloc(ncoded);
+		bench_transmit(&ch[p], coded, ncoded, bench_sigma(rate, p ? bench_ebn0[p - 1] : BENCH_CLEAN));
+	}
+	ref.buf = malloc(nbits / 8);
+	ref.size = nbits / 8;
+	ref.len = 0;
+	o.buf = malloc(nbits / 8);
+	o.size = nbits / 8;
+
+	printf("Code rate %s, %d bits:\n", viterbi_rate_name(rate), nbits);
+	printf("%-8s %-9s %7s", "kernel", "input", "Mbit/s");
+	for (int p = 0; p < BENCH_POINTS; p++)
+		printf("   BER@%.1fdB  BLER", bench_ebn0[p]);
+	printf("  exact\n");
+
+	for (int k = 0; viterbi_kernel_name(k); k++) {
+		if (!viterbi_select_kernel(viterbi_kernel_name(k)))
+			continue;
+
+		for (const bench_variant_t *var = bench_variants; var->name; var++) {
+			bench_errors_t e[BENCH_POINTS];
+			double t = 0.0;
+			int exact;
+
+			printf("%-8s %-9s", viterbi_kernel_name(k), var->name);
+
+			/* The first variant of all is the reference; on a clean
+			 * channel it had better decode to all of the data, and
+			 * every other variant to exactly what it did.  */
+			t += bench_decode(rate, var, &ch[0], &o);
+			if (k == 0 && var == bench_variants) {
+				memcpy(ref.buf, o.buf, o.len);
+				ref.len = o.len;
+				exact = o.len == nbits / 8 && !memcmp(o.buf, data, o.len);
+			} else {
+				exact = o.len == ref.len && !memcmp(o.buf, ref.buf, o.len);
+			}
+			failed += !exact;
+
+			for (int p = 0; p < BENCH_POINTS; p++) {
+				t += bench_decode(rate, var, &ch[p + 1], &o);
+				bench_count(&e[p], &o, data);
+			}
+
+			printf(" %7.1f", (double)nbits * (1 + BENCH_POINTS) / t / 1e6);
+			for (int p = 0; p < BENCH_POINTS; p++)
+				printf("   %.2e %.3f", e[p].bits ? (double)e[p].errs / e[p].bits : 1.0,
+				       e[p].blocks ? (double)e[p].blkerrs / e[p].blocks : 1.0);
+			printf("  %s\n", exact ? "yes" : "NO");
+			fflush(stdout);
+		}
+	}
+	printf("\n");
+
+	for (int p = 0; p <= BENCH_POINTS; p++) {
+		free(ch[p].bits);
+		free(ch[p].llrs);
+	}
+	free(data);
+	free(coded);
+	free(check);
+	free(ref.buf);
+	free(o.buf);
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	int nbits = BENCH_BITS, rate = -1, failed = 0;
+	int opt;
+
+	bench_rng = 0x9E3779B97F4A7C15ULL;
+
+	while ((opt = getopt(argc, argv, "n:r:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nbits = atoi(optarg);
+			if (nbits >= 8 * BENCH_BLOCK * 8)
+				break;
+			fprintf(stderr, "%s: need at least %d bits\n", argv[0], 8 * BENCH_BLOCK * 8);
+			return 1;
+		case 's':
+			bench_rng = strtoull(optarg, NULL, 0);
+			if (bench_rng)
+				break;
+			fprintf(stderr, "%s: seed must not be 0\n", argv[0]);
+			return 1;
+		case 'r':
+			rate = viterbi_rate_by_name(optarg);
+			if (rate >= 0)
+				break;
+			fprintf(stderr, "%s: unknown code rate %s\n", argv[0], optarg);
+			/* fall through */
+		default:
+			fprintf(stderr, "usage: %s [-n bits] [-r rate] [-s seed]\n", argv[0]);
+			fprintf(stderr, "  -n: information bits per run (default %d)\n", BENCH_BITS);
+			fprintf(stderr, "  -r: only this code rate: 1/2, 2/3, 3/4, 5/6 or 7/8 (default all)\n");
+			fprintf(stderr, "  -s: seed for the data and the noise\n");
+			return 1;
+		}
+	}
+
+	nbits -= nbits % BENCH_ROUND;
+	for (int r = 0; r < VITERBI_RATES; r++)
+		if (rate < 0 || r == rate)
+			failed += bench_rate(r, nbits);
+
+	if (failed) {
+		printf("%d variants did not match the reference decoder.\n", failed);
+		return 1;
+	}
+	printf("Every variant matched the reference decoder at Eb/N0 %.1f dB.\n", BENCH_CLEAN);
+	return 0;
+}
@@ -3,144 +3,107 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include "viterbi.h"
 
-// fast-ish iterative viterbi decoder for K=5
+/* Command-line front end for the inner decoder: coded bits (or LLRs) in on
+ * stdin, decoded bytes out on stdout.  For throughput and error rates over
+ * a simulated channel, see viterbi_bench (make bench-viterbi).  */
 
-#define DECISION_LEN 32
-#define OUTPUT_BITS 256
-#define VITERBI_BUFSZ (DECISION_LEN + OUTPUT_BITS + 8)
-/* n.b.: VITERBI_BUFSZ should be a multiple of 8 */
-
-#define VITERBI_K 5
-#define VITERBI_STATES (1 << (VITERBI_K + 1))
-
-struct viterbi_st {
-	uint32_t pm; /* path metric -- later could be uint16 probably with path metric normalization */
-	uint8_t pred_st; /* predecessor state */
-	uint8_t pred_trn; /* predecessor transition */
-};
-
-struct viterbi_st stbuf[VITERBI_BUFSZ][VITERBI_STATES];
-int sthead = 0; /* position of the first path element that hasn't yet been consumed */
-int sttail = 0; /* position of the next path to be written */
+void viterbi_write_stdout(void *priv, const uint8_t *buf, int len) {
+	(void) priv;
+	while (len > 0) {
+		ssize_t n = write(1, buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
 
-uint8_t xtab[VITERBI_STATES * 2];
-uint8_t ytab[VITERBI_STATES * 2];
+int main(int argc, char **argv) {
+	uint8_t inbuf[65536];
+	ssize_t len;
+	int soft = 0, threads = 0, depth = 0;
+	int rate = VITERBI_RATE_2_3;
+	int opt;
 
-void viterbi_init() {
-	/* generate tables */
-	for (int i = 0; i < VITERBI_STATES; i++) {
-		for (int inp = 0; inp < 2; inp++) {
-			xtab[i * 2 + inp] =
-				((i >> 0) & 1) ^
-				((i >> 3) & 1) ^
-				((i >> 4) & 1) ^
-				((i >> 5) & 1) ^
-				inp;
-			ytab[i * 2 + inp] =
-				((i >> 0) & 1) ^
-				((i >> 1) & 1) ^
-				((i >> 3) & 1) ^
-				((i >> 4) & 1) ^
-				inp;
+	while ((opt = getopt(argc, argv, "sr:j:l:")) != -1) {
+		switch (opt) {
+		case 's':
+			soft = 1;
+			break;
+		case 'l':
+			depth = atoi(optarg);
+			if (depth >= 1 && depth <= 56)
+				break;
+			fprintf(stderr, "%s: decision depth must be 1 - 56\n", argv[0]);
+			return 1;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'r':
+			rate = viterbi_rate_by_name(optarg);
+			if (rate >= 0)
+				break;
+			fprintf(stderr, "%s: unknown code rate %s\n", argv[0], optarg);
+			/* fall through */
+		default:
+			fprintf(stderr, "usage: %s [-s] [-r rate] [-j threads] [-l depth] < input > output\n", argv[0]);
+			fprintf(stderr, "  -s: input is one int8 LLR per coded bit, rather than packed hard bits\n");
+			fprintf(stderr, "  -r: code rate, as reported by TPS: 1/2, 2/3 (default), 3/4, 5/6 or 7/8\n");
+			fprintf(stderr, "  -j: read all of the input, then decode it in blocks on this many threads\n");
+			fprintf(stderr, "  -l: low latency: release each byte once its bits are this many steps old\n");
+			return 1;
 		}
 	}
-	
-	sthead = sttail = 0;
-	memset(stbuf, 0, sizeof(stbuf));
-}
 
-int viterbi_consume(int final);
+	if (threads > 0) {
+		uint8_t *all = NULL;
+		int64_t alllen = 0, allsz = 0;
 
-__attribute__((always_inline)) void viterbi(int hasx, uint8_t x, uint8_t y) {
-	for (int i = 0; i < VITERBI_STATES; i++) {
-		stbuf[sttail][i].pm = 0xFFFFFFFF;
-	}
-	
-	struct viterbi_st *prev = &stbuf[(sttail + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ][0];
-	struct viterbi_st *cur  = &stbuf[sttail][0];
-	
-	for (int i = 0; i < VITERBI_STATES; i++) {
-		for (int inp = 0; inp < 2; inp++) {
-			uint32_t pm = prev[i].pm;
-			if (hasx && x != xtab[i * 2 + inp]) pm++;
-			if (        y != ytab[i * 2 + inp]) pm++;
-			
-			uint8_t next = (i >> 1) | (inp << VITERBI_K);
-			if (cur[next].pm > pm) {
-				cur[next].pm = pm;
-				cur[next].pred_st = i;
-				cur[next].pred_trn = inp;
+		while ((len = read(0, inbuf, sizeof(inbuf))) > 0) {
+			if (alllen + len > allsz) {
+				allsz = (allsz + len) * 2;
+				all = realloc(all, allsz);
 			}
+			memcpy(all + alllen, inbuf, len);
+			alllen += len;
 		}
-	}
-	
-	sttail = (sttail + 1) % VITERBI_BUFSZ;
-	if (sttail == (sthead + DECISION_LEN + OUTPUT_BITS) % VITERBI_BUFSZ) {
-		(void) viterbi_consume(0);
-	}
-}
 
-/* Do a backwards pass, spitting out the first OUTPUT_BITS (or all of the
- * bits, if final).  */
-int viterbi_consume(int final) {
-	uint8_t outbuf[VITERBI_BUFSZ / 8] = {};
-	int outpos = (sttail + VITERBI_BUFSZ - sthead - 1) % VITERBI_BUFSZ;
-	int totbytes = outpos / 8;
-	
-	int vptr = (sttail + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ;
-	
-	/* Find the initial state with the best (most likely) path metric. */
-	int st = 0;
-	int pm = stbuf[vptr][st].pm;
-	for (int i = 0; i < VITERBI_STATES; i++)
-		if (stbuf[vptr][i].pm < stbuf[vptr][st].pm) {
-			st = i;
-			pm = stbuf[vptr][i].pm;
+		int64_t nout = viterbi_decode_parallel(rate, soft, all, soft ? alllen : alllen * 8, -1, threads,
+		                                       viterbi_write_stdout, NULL);
+		if (nout < 0) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
 		}
-	
-	/* Now do the reverse pass. */
-	while (vptr != (sthead + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ) {
-		outbuf[outpos / 8] |= stbuf[vptr][st].pred_trn << (7 - outpos % 8);
-		st = stbuf[vptr][st].pred_st;
-		vptr = (vptr + VITERBI_BUFSZ - 1) % VITERBI_BUFSZ;
-		outpos--;
+		fprintf(stderr, "Decoded %lld bytes on %d threads.\n", (long long)nout, threads);
+		free(all);
+		return 0;
 	}
-	
-	sthead = (sthead + OUTPUT_BITS) % VITERBI_BUFSZ;
-	write(1, outbuf, final ? totbytes : OUTPUT_BITS / 8);
-	
-	return pm;
-}
-
-int main() {
-	uint8_t *inbuf;
-	off_t inlen;
-	int inpos;
 
-	inlen = lseek(0, 0, SEEK_END);
-	lseek(0, 0, SEEK_SET);
-	inbuf = malloc(inlen);
-	read(0, inbuf, inlen);
-
-	viterbi_init();
-	for (inpos = 0; (inpos + 2) < inlen * 8; /* inpos incremented in loop */) {
-		uint8_t x, y;
-		
-		x = (inbuf[inpos / 8] >> (7 - (inpos % 8))) & 1;
-		inpos++;
-		
-		y = (inbuf[inpos / 8] >> (7 - (inpos % 8))) & 1;
-		inpos++;
-		
-		viterbi(1, x, y);
-		
-		y = (inbuf[inpos / 8] >> (7 - (inpos % 8))) & 1;
-		inpos++;
+	viterbi_t v;
+	if (viterbi_init(&v, rate, soft, viterbi_write_stdout, NULL) < 0) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	v.log = stderr;
+	if (depth)
+		viterbi_set_latency(&v, depth);
 
-		viterbi(0, 0, y);
+	while ((len = read(0, inbuf, sizeof(inbuf))) > 0) {
+		if (soft)
+			viterbi_push_llrs(&v, (int8_t *)inbuf, len);
+		else
+			viterbi_push_bits(&v, inbuf, len);
 	}
-	
-	int pm = viterbi_consume(1);
-	fprintf(stderr, "Path metric was %d.\n", pm);
+
+	int64_t pm = viterbi_flush(&v);
+	fprintf(stderr, "Path metric was %lld.\n", (long long)pm);
+	fprintf(stderr, "Locked %d times, slipped %d times; growth over the last window was %.3f.\n",
+	        v.syncs, v.slips, v.growth);
+	if (v.dec.nout)
+		fprintf(stderr, "Latency was %.1f steps per bit on average, %lld at worst.\n",
+		        (double)v.dec.lat_sum / v.dec.nout, (long long)v.dec.lat_max);
+	viterbi_free(&v);
+	return 0;
 }
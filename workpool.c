@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workpool.h"
+
+#define WORKPOOL_MASK (WORKPOOL_DEQUE - 1)
+
+/* The worker this thread is, if it's one of ours. */
+static __thread workpool_worker_t *workpool_self;
+
+static void workpool_push(workpool_worker_t *w, workpool_task_t *t, int yield) {
+	workpool_t *p = w->pool;
+
+	pthread_mutex_lock(&w->lock);
+	assert(w->bottom - w->top < WORKPOOL_DEQUE);
+	if (yield)
+		w->deque[--w->top & WORKPOOL_MASK] = t;
+	else
+		w->deque[w->bottom++ & WORKPOOL_MASK] = t;
+	pthread_mutex_unlock(&w->lock);
+
+	/* Either we see the sleeper, or it sees the task. */
+	__atomic_add_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+static workpool_task_t *workpool_pop(workpool_worker_t *w) {
+	workpool_task_t *t = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom != w->top)
+		t = w->deque[--w->bottom & WORKPOOL_MASK];
+	pthread_mutex_unlock(&w->lock);
+	if (t)
+		__atomic_sub_fetch(&w->pool->queued, 1, __ATOMIC_SEQ_CST);
+	return t;
+}
+
+static workpool_task_t *workpool_steal(workpool_worker_t *w) {
+	workpool_t *p = w->pool;
+	int first;
+
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 7;
+	w->rng ^= w->rng << 17;
+	first = w->rng % p->nthreads;
+
+	for (int i = 0; i < p->nthreads; i++) {
+		workpool_worker_t *v = &p->workers[(first + i) % p->nthreads];
+		workpool_task_t *t = NULL;
+
+		if (v == w)
+			continue;
+		pthread_mutex_lock(&v->lock);
+		if (v->bottom != v->top)
+			t = v->deque[v->top++ & WORKPOOL_MASK];
+		pthread_mutex_unlock(&v->lock);
+		if (t) {
+			__atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&w->steals, 1, __ATOMIC_RELAXED);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static int64_t workpool_cpu_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void workpool_run(workpool_worker_t *w, workpool_task_t *t) {
+	int64_t start, ns;
+	int again;
+
+	__atomic_store_n(&t->pending, 0, __ATOMIC_SEQ_CST);
+	start = workpool_cpu_ns();
+	again = t->run(t);
+	ns = workpool_cpu_ns() - start;
+
+	__atomic_add_fetch(&t->runs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->cpu_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&w->runs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&w->cpu_ns, ns, __ATOMIC_RELAXED);
+
+	/* Woken while it was running counts as wanting to go again.  If not,
+	 * it's idle; but anyone who woke it after we looked, and saw it was
+	 * still queued, left it to us.  */
+	if (again || __atomic_exchange_n(&t->pending, 0, __ATOMIC_SEQ_CST)) {
+		workpool_push(w, t, 1);
+		return;
+	}
+	__atomic_store_n(&t->queued, 0, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&t->pending, __ATOMIC_SEQ_CST) &&
+	    !__atomic_exchange_n(&t->queued, 1, __ATOMIC_SEQ_CST))
+		workpool_push(w, t, 1);
+}
+
+static void *workpool_main(void *priv) {
+	workpool_worker_t *w = priv;
+	workpool_t *p = w->pool;
+
+	workpool_self = w;
+	while (!__atomic_load_n(&p->quit, __ATOMIC_SEQ_CST)) {
+		workpool_task_t *t = workpool_pop(w);
+
+		if (!t)
+			t = workpool_steal(w);
+		if (t) {
+			workpool_run(w, t);
+			continue;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		__atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (!p->quit && !__atomic_load_n(&p->queued, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&p->cond, &p->lock);
+		__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+/* Start nthreads workers, or one per CPU if that's 0.  Returns 0, or -1
+ * if the threads couldn't be started.  */
+int workpool_init(workpool_t *p, int nthreads) {
+	memset(p, 0, sizeof(*p));
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > WORKPOOL_MAX_THREADS)
+		nthreads = WORKPOOL_MAX_THREADS;
+
+	p->workers = calloc(nthreads, sizeof(*p->workers));
+	if (!p->workers)
+		return -1;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->nthreads = nthreads;
+
+	for (int i = 0; i < nthreads; i++) {
+		workpool_worker_t *w = &p->workers[i];
+
+		w->pool = p;
+		w->id = i;
+		w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	for (int i = 0; i < nthreads; i++)
+		if (pthread_create(&p->workers[i].thread, NULL, workpool_main, &p->workers[i])) {
+			p->nthreads = i;
+			workpool_destroy(p);
+			return -1;
+		}
+	return 0;
+}
+
+void workpool_task_init(workpool_task_t *t, workpool_run_t run, void *priv) {
+	memset(t, 0, sizeof(*t));
+	t->run = run;
+	t->priv = priv;
+}
+
+/* Make sure t runs at least once more, starting after this.  From one of
+ * the workers, it goes on that worker's own deque, to run next; from
+ * anywhere else, it's dealt out to each worker in turn.  */
+void workpool_wake(workpool_t *p, workpool_task_t *t) {
+	workpool_worker_t *w = workpool_self;
+
+	__atomic_store_n(&t->pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&t->queued, 1, __ATOMIC_SEQ_CST))
+		return;
+	if (!w || w->pool != p)
+		w = &p->workers[__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->nthreads];
+	workpool_push(w, t, 0);
+}
+
+/* Stop the workers, once they've finished what they're running; anything
+ * still queued is left there.  */
+void workpool_destroy(workpool_t *p) {
+	pthread_mutex_lock(&p->lock);
+	__atomic_store_n(&p->quit, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->nthreads; i++)
+		pthread_join(p->workers[i].thread, NULL);
+	for (int i = 0; i < p->nthreads; i++)
+		pthread_mutex_destroy(&p->workers[i].lock);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p->workers);
+	p->workers = NULL;
+}
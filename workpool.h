@@ -0,0 +1,77 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* A fixed set of worker threads, shared by everything in the process,
+ * running small tasks.  Each worker has a deque of its own: tasks it
+ * wakes go on the bottom, and it takes its next task from there too, so
+ * that work follows the data it has just produced while that's still in
+ * cache.  A worker with nothing to do steals from the top of someone
+ * else's deque.
+ *
+ * A task is not a one-off: it's a piece of work that stays around, and is
+ * woken whenever there may be something for it to do.  There is only ever
+ * one copy of a task queued or running, so whatever it does is serialized
+ * without any locking.  Each run should do a bounded amount of work and
+ * return nonzero if there's more; it goes back on the top of the deque,
+ * behind everything else that's waiting, which is what keeps one busy
+ * task from starving the rest.  */
+
+#define WORKPOOL_MAX_THREADS 256
+#define WORKPOOL_DEQUE 1024 /* tasks per worker; a power of 2 */
+
+struct workpool_task;
+
+/* Do some work; return nonzero to be run again later. */
+typedef int (*workpool_run_t)(struct workpool_task *t);
+
+typedef struct workpool_task {
+	workpool_run_t run;
+	void *priv;
+
+	int queued; /* queued or running */
+	int pending; /* woken since the last run started */
+
+	/* Statistics */
+	int64_t runs;
+	int64_t cpu_ns; /* thread CPU time spent running it */
+} workpool_task_t;
+
+typedef struct workpool_worker {
+	struct workpool *pool;
+	pthread_t thread;
+	int id;
+
+	pthread_mutex_t lock;
+	workpool_task_t *deque[WORKPOOL_DEQUE];
+	unsigned top; /* oldest; thieves and yielding tasks use this end */
+	unsigned bottom; /* newest; the owner pushes and pops here */
+	uint64_t rng; /* where to try stealing from first */
+
+	/* Statistics */
+	int64_t runs;
+	int64_t steals;
+	int64_t cpu_ns;
+} workpool_worker_t;
+
+typedef struct workpool {
+	int nthreads;
+	workpool_worker_t *workers;
+
+	pthread_mutex_t lock; /* idle workers sleep on cond */
+	pthread_cond_t cond;
+	int sleepers;
+	int queued; /* tasks in all the deques */
+	int quit;
+	unsigned next; /* worker for the next task from outside the pool */
+} workpool_t;
+
+/* workpool.c */
+extern int workpool_init(workpool_t *p, int nthreads);
+extern void workpool_task_init(workpool_task_t *t, workpool_run_t run, void *priv);
+extern void workpool_wake(workpool_t *p, workpool_task_t *t);
+extern void workpool_destroy(workpool_t *p);
+
+#endif